@@ -0,0 +1,333 @@
+#!/usr/bin/env python3
+"""
+Load-test harness for streamserverclient.py.
+
+Starts synthetic MJPEG cameras and a real server process pointed at them,
+then runs simulated viewers against the page, the API and the relay:
+
+    python3 bench/loadtest.py --cameras 3 --fps 15 --frame-size 80000 \\
+        --page-clients 4 --api-clients 4 --relay-clients 30 --duration 20
+
+Reports requests/s and p50/p99 latency per route, the frame rate every relay
+viewer actually received, and the server's CPU and RSS. Pass --json to keep
+the numbers for comparing runs.
+"""
+
+import argparse
+import http.client
+import http.server
+import io
+import json
+import os
+import random
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+sys.path.insert(0, ROOT)
+from streamserverclient import MJPEGParser  # noqa: E402
+
+try:
+    from PIL import Image
+except ImportError:
+    Image = None
+
+
+def free_port():
+    with socket.socket() as sock:
+        sock.bind(('127.0.0.1', 0))
+        return sock.getsockname()[1]
+
+
+def synthetic_frames(width, height, frame_size, count=8):
+    """A few distinct JPEGs: real ones when Pillow is installed, sized filler otherwise"""
+    rng = random.Random(0)
+    frames = []
+    for i in range(count):
+        if Image is not None:
+            image = Image.effect_noise((width, height), 40 + i * 5).convert('RGB')
+            out = io.BytesIO()
+            image.save(out, 'JPEG', quality=85)
+            frames.append(out.getvalue())
+        else:
+            body = bytes(rng.randrange(0, 255) for _ in range(256)) * (frame_size // 256 + 1)
+            frames.append(b'\xff\xd8' + body[:frame_size - 4] + b'\xff\xd9')
+    return frames
+
+
+class CameraHandler(http.server.BaseHTTPRequestHandler):
+    """Serves an endless picamera2-style MJPEG stream"""
+
+    frames = []
+    fps = 10
+
+    def do_GET(self):
+        self.send_response(200)
+        self.send_header('Content-Type', 'multipart/x-mixed-replace; boundary=FRAME')
+        self.end_headers()
+        interval = 1.0 / self.fps
+        due = time.monotonic()
+        n = 0
+        try:
+            while True:
+                jpeg = self.frames[n % len(self.frames)]
+                self.wfile.write(b'--FRAME\r\nContent-Type: image/jpeg\r\nContent-Length: %d\r\n\r\n'
+                                 % len(jpeg) + jpeg + b'\r\n')
+                n += 1
+                due += interval
+                time.sleep(max(due - time.monotonic(), 0))
+        except OSError:
+            pass
+
+    def log_message(self, format, *args):
+        pass
+
+
+def start_cameras(count, fps, frames):
+    handler = type('Camera', (CameraHandler,), {'frames': frames, 'fps': fps})
+    cameras = []
+    for _ in range(count):
+        server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), handler)
+        server.daemon_threads = True
+        threading.Thread(target=server.serve_forever, daemon=True).start()
+        cameras.append(server)
+    return cameras
+
+
+def start_server(args, cameras):
+    port = free_port()
+    config = {
+        'streams': {
+            f'cam{i + 1}': {'name': f'Synthetic {i + 1}',
+                            'url': f'http://127.0.0.1:{camera.server_address[1]}/stream.mjpg'}
+            for i, camera in enumerate(cameras)
+        },
+        'server': {'host': '127.0.0.1', 'port': port, 'engine': args.engine},
+    }
+    if args.server_config:
+        config['server'].update(json.loads(args.server_config))
+    handle, path = tempfile.mkstemp(suffix='.json', prefix='loadtest-')
+    with os.fdopen(handle, 'w') as f:
+        json.dump(config, f)
+
+    process = subprocess.Popen([sys.executable, os.path.join(ROOT, 'streamserverclient.py'), '--config', path],
+                               stdout=subprocess.DEVNULL if not args.verbose else None,
+                               stderr=subprocess.DEVNULL if not args.verbose else None)
+    deadline = time.monotonic() + 10
+    while time.monotonic() < deadline:
+        try:
+            socket.create_connection(('127.0.0.1', port), timeout=0.2).close()
+            break
+        except OSError:
+            time.sleep(0.1)
+    else:
+        process.kill()
+        raise SystemExit("server did not start listening")
+    return process, port, path, list(config['streams'])
+
+
+class ProcessSampler(threading.Thread):
+    """Samples a process's CPU and RSS from /proc (Linux only)"""
+
+    def __init__(self, pid, interval=0.5):
+        super().__init__(daemon=True)
+        self.pid = pid
+        self.interval = interval
+        self.cpu_samples = []
+        self.rss_samples = []
+        self._stop = threading.Event()
+        self._ticks = os.sysconf('SC_CLK_TCK') if hasattr(os, 'sysconf') else 100
+
+    def _read(self):
+        with open(f'/proc/{self.pid}/stat') as f:
+            fields = f.read().rsplit(')', 1)[1].split()
+        cpu = (int(fields[11]) + int(fields[12])) / self._ticks
+        with open(f'/proc/{self.pid}/status') as f:
+            rss = next(int(line.split()[1]) for line in f if line.startswith('VmRSS:'))
+        return cpu, rss * 1024
+
+    def run(self):
+        try:
+            last_cpu, _ = self._read()
+        except OSError:
+            return
+        last_time = time.monotonic()
+        while not self._stop.wait(self.interval):
+            try:
+                cpu, rss = self._read()
+            except OSError:
+                return
+            now = time.monotonic()
+            self.cpu_samples.append((cpu - last_cpu) / (now - last_time) * 100)
+            self.rss_samples.append(rss)
+            last_cpu, last_time = cpu, now
+
+    def stop(self):
+        self._stop.set()
+
+
+def request_loop(port, path, headers, results, stop):
+    """Repeatedly GET one route over fresh connections, recording latency"""
+    while not stop.is_set():
+        start = time.perf_counter()
+        try:
+            conn = http.client.HTTPConnection('127.0.0.1', port, timeout=10)
+            conn.request('GET', path, headers=headers)
+            response = conn.getresponse()
+            response.read()
+            conn.close()
+            ok = response.status < 400
+        except OSError:
+            ok = False
+        results.append((time.perf_counter() - start, ok))
+
+
+def relay_viewer(port, path, stats, stop):
+    """Hold a relay stream open and count the frames it delivers"""
+    record = {'path': path, 'frames': 0, 'first_frame': None, 'error': None}
+    stats.append(record)
+    start = time.perf_counter()
+    try:
+        conn = http.client.HTTPConnection('127.0.0.1', port, timeout=10)
+        conn.request('GET', path)
+        response = conn.getresponse()
+        if response.status != 200:
+            record['error'] = f'HTTP {response.status}'
+            return
+        parser = MJPEGParser.for_content_type(response.getheader('Content-Type'))
+        record['start'] = time.perf_counter()
+        while not stop.is_set():
+            chunk = response.read1(65536)
+            if not chunk:
+                break
+            frames = len(parser.feed(chunk))
+            if frames and record['first_frame'] is None:
+                record['first_frame'] = time.perf_counter() - start
+            record['frames'] += frames
+        record['end'] = time.perf_counter()
+        conn.close()
+    except OSError as e:
+        record['error'] = str(e)
+
+
+def percentile(values, fraction):
+    if not values:
+        return float('nan')
+    values = sorted(values)
+    return values[min(int(len(values) * fraction), len(values) - 1)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--cameras', type=int, default=3, help='synthetic MJPEG sources')
+    parser.add_argument('--fps', type=float, default=15, help='frame rate of each source')
+    parser.add_argument('--resolution', default='1280x720',
+                        help='source resolution (needs Pillow; otherwise --frame-size is used)')
+    parser.add_argument('--frame-size', type=int, default=80_000, help='bytes per frame without Pillow')
+    parser.add_argument('--page-clients', type=int, default=2, help='clients looping on /')
+    parser.add_argument('--api-clients', type=int, default=2, help='clients looping on /api/streams')
+    parser.add_argument('--relay-clients', type=int, default=10, help='viewers held open on /relay/<id>')
+    parser.add_argument('--relay-path', default='/relay/{id}', help='relay route template, e.g. /relay/{id}/thumb')
+    parser.add_argument('--duration', type=float, default=15, help='seconds to measure')
+    parser.add_argument('--engine', default='pool', help='server engine to test')
+    parser.add_argument('--server-config', help='JSON merged into the server block, e.g. \'{"workers": 4}\'')
+    parser.add_argument('--json', help='write the results to this file')
+    parser.add_argument('--verbose', action='store_true', help='show the server output')
+    args = parser.parse_args()
+
+    width, height = (int(v) for v in args.resolution.split('x'))
+    frames = synthetic_frames(width, height, args.frame_size)
+    cameras = start_cameras(args.cameras, args.fps, frames)
+    process, port, config_path, stream_ids = start_server(args, cameras)
+    print(f"server pid {process.pid} on port {port}, {args.cameras} cameras at {args.fps} fps, "
+          f"{sum(map(len, frames)) // len(frames)} byte frames")
+
+    # Let the relays connect before measuring
+    time.sleep(1.5)
+    sampler = ProcessSampler(process.pid)
+    sampler.start()
+    stop = threading.Event()
+    threads = []
+    routes = {'/': [], '/api/streams': []}
+    relay_stats = []
+    for _ in range(args.page_clients):
+        threads.append(threading.Thread(target=request_loop, daemon=True,
+                                        args=(port, '/', {'Accept-Encoding': 'gzip'}, routes['/'], stop)))
+    for _ in range(args.api_clients):
+        threads.append(threading.Thread(target=request_loop, daemon=True,
+                                        args=(port, '/api/streams', {}, routes['/api/streams'], stop)))
+    for i in range(args.relay_clients):
+        path = args.relay_path.format(id=stream_ids[i % len(stream_ids)])
+        threads.append(threading.Thread(target=relay_viewer, daemon=True, args=(port, path, relay_stats, stop)))
+
+    started = time.perf_counter()
+    for thread in threads:
+        thread.start()
+    try:
+        time.sleep(args.duration)
+    finally:
+        stop.set()
+        elapsed = time.perf_counter() - started
+        for thread in threads:
+            thread.join(timeout=5)
+        sampler.stop()
+        process.send_signal(signal.SIGINT)
+        try:
+            process.wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            process.kill()
+        os.unlink(config_path)
+        for camera in cameras:
+            camera.shutdown()
+
+    report = {'duration': elapsed, 'routes': {}, 'relay': {}, 'server': {}}
+    print(f"\n{'route':<14} {'requests':>9} {'req/s':>9} {'p50 ms':>8} {'p99 ms':>8} {'errors':>7}")
+    for route, results in routes.items():
+        latencies = [latency * 1000 for latency, ok in results if ok]
+        errors = sum(1 for _, ok in results if not ok)
+        entry = {'requests': len(results), 'rps': len(results) / elapsed,
+                 'p50_ms': percentile(latencies, 0.5), 'p99_ms': percentile(latencies, 0.99), 'errors': errors}
+        report['routes'][route] = entry
+        print(f"{route:<14} {entry['requests']:>9} {entry['rps']:>9.1f} {entry['p50_ms']:>8.2f} "
+              f"{entry['p99_ms']:>8.2f} {errors:>7}")
+
+    viewer_fps = [r['frames'] / (r['end'] - r['start']) for r in relay_stats
+                  if 'end' in r and r['end'] > r['start']]
+    first_frames = [r['first_frame'] * 1000 for r in relay_stats if r['first_frame'] is not None]
+    failed = [r for r in relay_stats if r['error']]
+    report['relay'] = {'viewers': len(relay_stats), 'failed': len(failed),
+                       'fps_mean': sum(viewer_fps) / len(viewer_fps) if viewer_fps else 0.0,
+                       'fps_min': min(viewer_fps, default=0.0),
+                       'first_frame_p50_ms': percentile(first_frames, 0.5),
+                       'first_frame_p99_ms': percentile(first_frames, 0.99)}
+    relay = report['relay']
+    if relay_stats:
+        print(f"\nrelay viewers: {relay['viewers']} ({relay['failed']} failed), "
+              f"delivered fps mean {relay['fps_mean']:.1f} / min {relay['fps_min']:.1f} (source {args.fps}), "
+              f"first frame p50 {relay['first_frame_p50_ms']:.1f} ms / p99 {relay['first_frame_p99_ms']:.1f} ms")
+        for record in failed[:5]:
+            print(f"  {record['path']}: {record['error']}")
+
+    if sampler.cpu_samples:
+        report['server'] = {'cpu_mean_pct': sum(sampler.cpu_samples) / len(sampler.cpu_samples),
+                            'cpu_max_pct': max(sampler.cpu_samples),
+                            'rss_max_mb': max(sampler.rss_samples) / 1e6}
+        server = report['server']
+        print(f"server: CPU mean {server['cpu_mean_pct']:.1f}% / max {server['cpu_max_pct']:.1f}%, "
+              f"RSS max {server['rss_max_mb']:.1f} MB")
+    else:
+        print("server: CPU/RSS unavailable (needs /proc)")
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(report, f, indent=2)
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
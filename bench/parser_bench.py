@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""
+Microbenchmark for the relay's incremental MJPEG parser.
+
+Feeds synthetic streams in the framings used by picamera2, mjpg-streamer,
+Motion and boundary-only servers through MJPEGParser and reports frames/s,
+MB/s and the CPU one stream would cost at a typical camera frame rate.
+Run it on the Pi itself for meaningful numbers:
+
+    python3 bench/parser_bench.py --frame-size 120000 --camera-fps 30
+"""
+
+import argparse
+import os
+import random
+import sys
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+from streamserverclient import MJPEGParser  # noqa: E402
+
+
+def make_jpeg(size, rng):
+    """Fake JPEG: SOI, marker-free payload, EOI"""
+    body = bytes(rng.randrange(0, 255) for _ in range(256)) * (size // 256 + 1)
+    return b'\xff\xd8' + body[:max(size - 4, 0)] + b'\xff\xd9'
+
+
+def picamera2(jpeg):
+    return (b'--FRAME\r\nContent-Type: image/jpeg\r\nContent-Length: %d\r\n\r\n' % len(jpeg)
+            + jpeg + b'\r\n')
+
+
+def mjpg_streamer(jpeg):
+    return (b'Content-Type: image/jpeg\r\nContent-Length: %d\r\nX-Timestamp: 1700000000.000000\r\n\r\n'
+            % len(jpeg) + jpeg + b'\r\n--boundarydonotcross\r\n')
+
+
+def motion(jpeg):
+    # Motion pads Content-Length to nine characters
+    return (b'--BoundaryString\r\nContent-type: image/jpeg\r\nContent-Length: %9d\r\n\r\n'
+            % len(jpeg) + jpeg + b'\r\n')
+
+
+def boundary_only(jpeg):
+    return b'--myboundary\r\nContent-Type: image/jpeg\r\n\r\n' + jpeg + b'\r\n'
+
+
+def bare_jpegs(jpeg):
+    return jpeg
+
+
+VARIANTS = {
+    'picamera2': (picamera2, 'FRAME'),
+    'mjpg-streamer': (mjpg_streamer, 'boundarydonotcross'),
+    'motion': (motion, 'BoundaryString'),
+    'boundary-only': (boundary_only, '--myboundary'),
+    'bare-jpegs': (bare_jpegs, None),
+}
+
+
+def build_stream(variant, frame_size, frames, seed=0):
+    rng = random.Random(seed)
+    wrap, boundary = VARIANTS[variant]
+    jpegs = [make_jpeg(int(frame_size * rng.uniform(0.8, 1.2)), rng) for _ in range(8)]
+    prefix = b'\r\n--boundarydonotcross\r\n' if variant == 'mjpg-streamer' else b''
+    data = prefix + b''.join(wrap(jpegs[i % len(jpegs)]) for i in range(frames))
+    return data, boundary, [jpegs[i % len(jpegs)] for i in range(frames)]
+
+
+def run(variant, frame_size, frames, chunk_size, camera_fps):
+    data, boundary, expected = build_stream(variant, frame_size, frames)
+    chunks = [data[i:i + chunk_size] for i in range(0, len(data), chunk_size)]
+    parser = MJPEGParser(boundary)
+
+    wall = time.perf_counter()
+    cpu = time.process_time()
+    parsed = []
+    for chunk in chunks:
+        parsed.extend(parser.feed(chunk))
+    cpu = time.process_time() - cpu
+    wall = time.perf_counter() - wall
+
+    # Without a trailing delimiter the last bare frame can't be told complete yet
+    complete = len(parsed) >= len(expected) - 1 and parsed == expected[:len(parsed)]
+    per_frame = cpu / max(len(parsed), 1)
+    print(f"{variant:>14}  chunk={chunk_size:>6}  frames={len(parsed):>5}  "
+          f"{len(parsed) / wall:>9.0f} frames/s  {len(data) / wall / 1e6:>8.1f} MB/s  "
+          f"{per_frame * 1e6:>7.1f} us/frame  {per_frame * camera_fps * 100:>5.2f}% CPU @ {camera_fps} fps  "
+          f"{'ok' if complete else 'MISMATCH'}")
+    return complete
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('--frame-size', type=int, default=100_000, help='average JPEG size in bytes')
+    parser.add_argument('--frames', type=int, default=500, help='frames per run')
+    parser.add_argument('--chunk-size', type=int, action='append',
+                        help='upstream read size (repeatable, default 1460 and 65536)')
+    parser.add_argument('--camera-fps', type=int, default=30, help='frame rate used for the CPU estimate')
+    parser.add_argument('--variant', choices=sorted(VARIANTS), action='append',
+                        help='stream framing to test (repeatable, default all)')
+    args = parser.parse_args()
+
+    ok = True
+    for variant in args.variant or VARIANTS:
+        for chunk_size in args.chunk_size or (1460, 65536):
+            ok &= run(variant, args.frame_size, args.frames, chunk_size, args.camera_fps)
+    return 0 if ok else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
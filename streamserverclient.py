@@ -1,228 +1,4197 @@
 #!/usr/bin/env python3
 """
-Minimal HTTP Server for displaying three video streams from remote Raspberry Pi devices.
+Minimal HTTP Server for displaying video streams from remote Raspberry Pi devices.
 """
 
+import argparse
+import asyncio
+import fractions
+import functools
+import http.client
 import http.server
-import socketserver
 import os
 import json
-from urllib.parse import urlparse, parse_qs
+import mimetypes
+import threading
+import collections
+import time
+import random
+import re
+import bisect
+import urllib.request
+import selectors
+import socket
+import queue
+import gzip
+import hashlib
+import html
+import io
+import email.utils
+import sys
+import ipaddress
+import shutil
+import signal
+import struct
+import subprocess
+import math
+import itertools
+import multiprocessing
+import multiprocessing.connection
+from multiprocessing import shared_memory
+from concurrent.futures import ThreadPoolExecutor
+from urllib.parse import urlparse, parse_qs, unquote, urljoin
+
+try:
+    import brotli
+except ImportError:
+    brotli = None
+
+try:
+    from PIL import Image, ImageChops
+except ImportError:
+    Image = ImageChops = None
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+try:
+    import uvloop
+except ImportError:
+    uvloop = None
+
+try:
+    import av
+    from aiortc import (RTCConfiguration, RTCIceServer, RTCPeerConnection, RTCRtpSender, RTCSessionDescription,
+                        VideoStreamTrack)
+    from aiortc.mediastreams import MediaStreamError
+except ImportError:
+    RTCPeerConnection = None
+    VideoStreamTrack = object
+
+CONFIG_PATH = os.path.join(os.path.dirname(__file__), 'config.json')
+CONFIG_POLL_SECONDS = 2
+DEFAULT_STREAMS = {
+    'stream1': 'http://192.168.1.100:8080/stream',
+    'stream2': 'http://192.168.1.101:8080/stream',
+    'stream3': 'http://192.168.1.102:8080/stream'
+}
+
+# Upstream encodings: MJPEG is relayed frame by frame, H.264 is remuxed by ffmpeg
+STREAM_FORMATS = ('mjpeg', 'h264', 'rtsp')
+
+RELAY_BOUNDARY = 'FRAME'
+PART_TRAILER = b'\r\n'
+RELAY_RING_SIZE = 8
+RELAY_CHUNK_SIZE = 64 * 1024
+RELAY_MAX_FRAME_SIZE = 8 * 1024 * 1024
+RELAY_RETRY_SECONDS = 5
+RELAY_STALL_SECONDS = 10
+RELAY_BACKOFF_BASE = 1
+RELAY_BACKOFF_MAX = 60
+RELAY_FPS_WINDOW = 30
+RELAY_LINGER_SECONDS = 30
+RELAY_BUFFER_MB = 4
+RELAY_MEMORY_LIMIT_MB = 256
+RELAY_BACKPRESSURE_SECONDS = 1
+RELAY_BACKPRESSURE_POLL = 0.05
+RELAY_MAX_REDIRECTS = 3
+
+# Per-hop frame latency; samples outside this range mean unsynchronised clocks
+LATENCY_MAX_SECONDS = 60
+LATENCY_REPORT_MAX_BYTES = 4096
+LATENCY_REPORT_MAX_SAMPLES = 20
+LATENCY_HOPS = ('upstream', 'relay', 'browser', 'glass')
+LATENCY_PAGE_HOPS = LATENCY_HOPS[2:]  # measured by the page and reported back
+
+EVENT_QUEUE_SIZE = 64
+EVENT_STATS_INTERVAL = 2
+EVENT_HEARTBEAT_SECONDS = 15
+EVENT_RETRY_MS = 3000
+# A streaming client that takes none of a write for this long is disconnected
+STREAM_WRITE_TIMEOUT = 30
+
+# DCT-domain scale factors libjpeg can decode at, largest reduction first
+THUMB_SCALES = (8, 4, 2)
+THUMB_TARGET_HEIGHT = 300
+THUMB_QUALITY = 70
+# Page tiles that stream live per tab; the rest poll snapshots
+PAGE_LIVE_STREAMS = 3
+THUMB_IDLE_SECONDS = 5
+
+RECORD_DIRECTORY = os.path.join(os.path.dirname(__file__), 'recordings')
+STATIC_DIRECTORY = os.path.join(os.path.dirname(__file__), 'static')
+STATIC_CACHE_BYTES = 16 * 1024 * 1024
+STATIC_CACHE_FILE_BYTES = 256 * 1024
+STATIC_REVALIDATE_SECONDS = 2
+STATIC_IMMUTABLE_MAX_AGE = 365 * 24 * 3600
+# app.3f2a9c1d.js: a content hash in the name means the file never changes
+STATIC_FINGERPRINT = re.compile(r'\.[0-9a-f]{8,}\.[0-9a-z]+$')
+RECORD_PRE_SECONDS = 10
+RECORD_POST_SECONDS = 20
+RECORD_PRE_MAX_BYTES = 64 * 1024 * 1024
+RECORD_QUEUE_MAX_BYTES = 64 * 1024 * 1024
+RECORD_WRITE_BUFFER = 1024 * 1024
+
+MOTION_RATE = 2
+MOTION_SIZE = (64, 48)
+MOTION_PIXEL_THRESHOLD = 24
+MOTION_THRESHOLD = 0.02
+MOTION_COOLDOWN_SECONDS = 5
+MOTION_WORKERS = 2
+
+# Hardware encoders first: the Pi 4's V4L2 mem2mem H.264 block, then software
+TRANSCODE_ENCODERS = ('h264_v4l2m2m', 'libx264')
+TRANSCODE_BITRATE = '1500k'
+TRANSCODE_SEGMENT_SECONDS = 1
+TRANSCODE_PLAYLIST_SEGMENTS = 6
+TRANSCODE_IDLE_SECONDS = 30
+TRANSCODE_START_SECONDS = 10
+TRANSCODE_LIVE_BACKLOG = 32
+
+WEBRTC_ANSWER_SECONDS = 10
+WEBRTC_MAX_OFFER_BYTES = 64 * 1024
+WEBRTC_CLOCK_RATE = 90000
+WEBRTC_DECODE_WORKERS = 2
+# H.264 access units a peer may fall behind before skipping to the next keyframe
+WEBRTC_PACKET_BACKLOG = 60
+WEBRTC_GOP_CACHE_BYTES = 4 * 1024 * 1024
+H264_AUD = b'\x00\x00\x01\x09'
+
+PEER_POLL_SECONDS = 30
+PEER_TIMEOUT_SECONDS = 5
+
+# Routes whose responses stay open indefinitely and are served from the stream pool
+STREAMING_ROUTES = ('/relay/', '/api/events')
+DEFAULT_ENGINE = 'pool'
+DEFAULT_WORKERS = 16
+DEFAULT_STREAM_WORKERS = 64
+REQUEST_LINE_TIMEOUT = 30
+# How long a request line split across segments is re-peeked before routing without it
+ROUTE_PEEK_BYTES = 256
+ROUTE_PEEK_SECONDS = 0.5
+ROUTE_PEEK_INTERVAL = 0.01
+KEEPALIVE_TIMEOUT = 15
+KEEPALIVE_MAX_REQUESTS = 100
+DISCARD_BODY_MAX_BYTES = 64 * 1024
+# On shutdown in-flight requests get this long; pages are told to reconnect this soon
+DRAIN_SECONDS = 5
+DRAIN_POLL_SECONDS = 0.05
+DRAIN_RETRY_MS = 250
+# First descriptor systemd passes to a socket-activated service
+SD_LISTEN_FDS_START = 3
+# Multi-process mode: frames the ingest process keeps per stream in shared memory,
+# and how workers talk back to it
+SHARED_RING_SLOTS = 4
+SHARED_RING_HEADER = struct.Struct('<QI')    # newest sequence number, slot payload size
+SHARED_SLOT_HEADER = struct.Struct('<QddI')  # sequence number, timestamp, capture time (NaN if unknown), size
+WORKER_QUEUE_SIZE = 1024
+WORKER_RPC_SECONDS = 5
+WORKER_METRICS_SECONDS = 5
+WORKER_RESTART_SECONDS = 1
+
+LOG_LEVELS = {'debug': 10, 'info': 20, 'warning': 30, 'error': 40, 'off': 100}
+ACCESS_LOG_FLUSH_SECONDS = 1
+ACCESS_LOG_QUEUE_SIZE = 10000
+
+
+class ConfigStore:
+    """config.json loaded once per process and hot-reloaded when the file changes
+
+    A background thread polls the file's mtime, so request handlers only ever
+    read the cached values and never touch the disk.
+    """
+
+    def __init__(self, path=CONFIG_PATH):
+        self.path = path
+        self.config = {}
+        self.video_streams = {}
+        self.stream_formats = {}
+        self._file_config = {}
+        self._remote_streams = {}
+        self._signature = None
+        self._listeners = []
+        self._lock = threading.Lock()
+        self._stop = threading.Event()
+        self.reload(initial=True)
+
+    @property
+    def server(self):
+        return self.config.get('server', {})
+
+    @property
+    def relay(self):
+        return self.config.get('relay', {})
+
+    @property
+    def recording(self):
+        return self.config.get('recording', {})
+
+    @property
+    def motion(self):
+        return self.config.get('motion', {})
+
+    @property
+    def transcode(self):
+        return self.config.get('transcode', {})
+
+    @property
+    def webrtc(self):
+        return self.config.get('webrtc', {})
+
+    @property
+    def peers(self):
+        return self.config.get('peers', {})
+
+    def add_listener(self, callback):
+        """Call callback(store) after every successful reload"""
+        self._listeners.append(callback)
+
+    def _stat_signature(self):
+        try:
+            st = os.stat(self.path)
+        except FileNotFoundError:
+            return None
+        return (st.st_ino, st.st_mtime_ns, st.st_size)
+
+    def reload(self, initial=False):
+        """Re-read config.json, keeping the previous config if the new one is invalid"""
+        self._signature = self._stat_signature()
+        try:
+            with open(self.path, 'r') as f:
+                config = json.load(f)
+
+            missing = [stream_id for stream_id, info in config['streams'].items() if 'url' not in info]
+            if missing:
+                raise ValueError(f"streams without a url: {', '.join(missing)}")
+        except FileNotFoundError:
+            if not initial:
+                print("⚠️  config.json disappeared, keeping the current configuration")
+                return False
+            print("⚠️  config.json not found, using default URLs")
+            config = {'streams': {stream_id: {'name': stream_id, 'url': url}
+                                  for stream_id, url in DEFAULT_STREAMS.items()}}
+        except Exception as e:
+            print(f"❌ Error loading config: {e}")
+            if not initial:
+                return False
+            config = {}
+
+        with self._lock:
+            self._file_config = config
+            self._publish(None if initial else "🔄 config.json reloaded")
+        return True
+
+    def set_remote_streams(self, streams):
+        """Offer streams relayed from peer servers alongside config.json's own"""
+        with self._lock:
+            if streams == self._remote_streams:
+                return
+            self._remote_streams = streams
+            self._publish("🌐 Peer streams updated")
+
+    def apply(self, config):
+        """Adopt a config merged by another process, as a worker does from the ingest process"""
+        with self._lock:
+            self._file_config = config
+            self._remote_streams = {}
+            self._publish('')
+
+    def _publish(self, message):
+        # A local stream wins over a peer's stream of the same id
+        streams = dict(self._file_config.get('streams', {}))
+        for stream_id, stream_info in self._remote_streams.items():
+            streams.setdefault(stream_id, stream_info)
+        config = dict(self._file_config, streams=streams)
+
+        # Swap in fresh objects so readers always see a consistent snapshot
+        self.config = config
+        self.video_streams = {stream_id: info['url'] for stream_id, info in streams.items()}
+        self.stream_formats = {stream_id: info.get('format', 'mjpeg') for stream_id, info in streams.items()}
+        # No message means the initial load, before anyone listens; an empty one stays quiet
+        if message is not None:
+            if message:
+                print(message)
+            for callback in self._listeners:
+                try:
+                    callback(self)
+                except Exception as e:
+                    print(f"❌ Error applying reloaded config: {e}")
+
+    def watch(self, interval=CONFIG_POLL_SECONDS):
+        """Start polling config.json for changes in a background thread"""
+        threading.Thread(target=self._watch, args=(interval,), name='config-watch', daemon=True).start()
+
+    def stop(self):
+        self._stop.set()
+
+    def _watch(self, interval):
+        while not self._stop.wait(interval):
+            if self._stat_signature() != self._signature:
+                self.reload()
+
+
+class PeerDirectory(threading.Thread):
+    """Polls peer servers' /api/streams and offers their cameras as local streams
+
+    Each remote stream becomes '<peer>-<stream>', pointed at the peer's relay,
+    so it crosses the WAN once (and only while someone here watches it) and is
+    fanned out locally like any other camera. A peer that stops answering keeps
+    its last known streams; their relays simply report the upstream offline.
+    """
+
+    def __init__(self, config):
+        super().__init__(name='peers', daemon=True)
+        self.config = config
+        self.peers = {}
+        self.up = {}
+        self.streams = {}
+        self._wake = threading.Event()
+        self._stop = threading.Event()
+        self.configure(config)
+
+    def configure(self, store):
+        """Pick up an edited peers block; called for every config change"""
+        if store.peers != self.peers:
+            self.peers = store.peers
+            self._wake.set()
+
+    def stop(self):
+        self._stop.set()
+        self._wake.set()
+
+    def run(self):
+        while not self._stop.is_set():
+            self._wake.clear()
+            self.poll()
+            self._wake.wait(PEER_POLL_SECONDS)
+
+    def poll(self):
+        """Refresh every peer's listing and publish the combined remote streams"""
+        peers = self.peers
+        for peer_id in list(self.streams):
+            if peer_id not in peers:
+                del self.streams[peer_id]
+                self.up.pop(peer_id, None)
+        for peer_id, peer in peers.items():
+            streams = self._fetch(peer_id, peer)
+            if streams is not None:
+                self.streams[peer_id] = streams
+        remote = {}
+        for streams in self.streams.values():
+            remote.update(streams)
+        self.config.set_remote_streams(remote)
+
+    def _fetch(self, peer_id, peer):
+        base = str(peer.get('url', '')).rstrip('/') + '/'
+        try:
+            with urllib.request.urlopen(urljoin(base, 'api/streams'), timeout=PEER_TIMEOUT_SECONDS) as response:
+                listing = json.load(response)
+            if not isinstance(listing, dict):
+                raise ValueError('not a stream listing')
+        except (OSError, ValueError) as e:
+            if self.up.get(peer_id, True):
+                print(f"⚠️  Peer {peer_id} unreachable: {e}")
+            self.up[peer_id] = False
+            return None
+        if not self.up.get(peer_id):
+            print(f"🌐 Peer {peer_id} lists {len(listing)} stream(s)")
+        self.up[peer_id] = True
+
+        site = peer.get('name', peer_id)
+        streams = {}
+        for stream_id, entry in listing.items():
+            # Streams the peer federates itself would add another WAN hop, or loop back here
+            if not isinstance(entry, dict) or entry.get('peer') or not isinstance(entry.get('url'), str):
+                continue
+            if entry.get('format', 'mjpeg') != 'mjpeg':
+                continue
+            streams[f'{peer_id}-{stream_id}'] = {
+                'name': f"{site} · {entry.get('name', stream_id)}",
+                'description': entry.get('description', ''),
+                'url': urljoin(base, entry['url']),
+                'peer': peer_id,
+            }
+        return streams
+
+    def collect_metrics(self):
+        """Gauges sampled at scrape time for /metrics"""
+        samples = []
+        for peer_id in self.peers:
+            labels = (('peer', peer_id),)
+            samples.append(('streamserver_peer_up', labels, int(self.up.get(peer_id, False))))
+            samples.append(('streamserver_peer_streams', labels, len(self.streams.get(peer_id, {}))))
+        return samples
+
+
+class ShardedCounters:
+    """Counters kept in one dict per thread and only summed when scraped
+
+    Incrementing touches nothing but the calling thread's own dict, so the
+    hot path takes no lock. Shards of threads that have exited are folded
+    into a shared total whenever a new thread registers its shard or the
+    counters are scraped, so one thread per connection can't pile them up.
+    """
+
+    def __init__(self):
+        self._local = threading.local()
+        self._shards = []
+        self._retired = collections.Counter()
+        self._lock = threading.Lock()
+
+    def inc(self, key, amount=1):
+        try:
+            shard = self._local.shard
+        except AttributeError:
+            shard = self._local.shard = {}
+            with self._lock:
+                live = self._prune()
+                live.append((threading.current_thread(), shard))
+        shard[key] = shard.get(key, 0) + amount
+
+    def _prune(self):
+        # Called under the lock; an exited thread can't touch its shard any more
+        live = []
+        for thread, shard in self._shards:
+            if thread.is_alive():
+                live.append((thread, shard))
+            else:
+                self._retired.update(shard)
+        self._shards = live
+        return live
+
+    def totals(self):
+        with self._lock:
+            live = list(self._prune())
+            totals = collections.Counter(self._retired)
+        for _, shard in live:
+            # dict.copy() runs entirely in C, so it can't see a half-applied update
+            totals.update(shard.copy())
+        return totals
+
+
+class Metrics:
+    """Prometheus metrics: sharded counters and histograms plus scrape-time collectors"""
+
+    def __init__(self):
+        self._counters = ShardedCounters()
+        self._types = {}
+        self._buckets = {}
+        self._collectors = []
+
+    def describe(self, name, kind, help_text, buckets=None):
+        self._types[name] = (kind, help_text)
+        if buckets is not None:
+            self._buckets[name] = buckets
+
+    def inc(self, name, labels=(), amount=1):
+        self._counters.inc((name, labels), amount)
+
+    def observe(self, name, labels, value):
+        """Record a histogram sample; buckets are made cumulative at scrape time"""
+        buckets = self._buckets[name]
+        index = bisect.bisect_left(buckets, value)
+        inc = self._counters.inc
+        inc((name, labels, index), 1)
+        inc((name + '_sum', labels), value)
+
+    def add_collector(self, collector):
+        """collector() returns [(name, labels, value)] of gauges sampled at scrape time"""
+        self._collectors.append(collector)
+
+    @staticmethod
+    def _labels(labels):
+        if not labels:
+            return ''
+        escaped = (str(value).replace('\\', '\\\\').replace('"', '\\"').replace('\n', '\\n')
+                   for _, value in labels)
+        return '{' + ','.join(f'{key}="{value}"' for (key, _), value in zip(labels, escaped)) + '}'
+
+    def snapshot(self):
+        """This process's counter totals and collected gauges, for another process to render"""
+        return self._counters.totals(), [sample for collector in self._collectors for sample in collector()]
+
+    def render(self, others=()):
+        """Text exposition format for /metrics, merged with snapshot()s of worker processes"""
+        # Samples with the same name and labels are summed into one series
+        samples = collections.defaultdict(collections.Counter)
+        histograms = collections.defaultdict(lambda: collections.defaultdict(collections.Counter))
+        for totals, collected in (self.snapshot(), *others):
+            for key, value in totals.items():
+                if len(key) == 3:
+                    name, labels, index = key
+                    histograms[name][labels][index] += value
+                else:
+                    samples[key[0]][key[1]] += value
+            for name, labels, value in collected:
+                samples[name][labels] += value
+
+        lines = []
+        for name, (kind, help_text) in self._types.items():
+            lines.append(f'# HELP {name} {help_text}')
+            lines.append(f'# TYPE {name} {kind}')
+            if kind == 'histogram':
+                buckets = self._buckets[name]
+                sums = samples.get(name + '_sum', {})
+                for labels, counts in histograms.get(name, {}).items():
+                    cumulative = 0
+                    for index, bound in enumerate(buckets):
+                        cumulative += counts.get(index, 0)
+                        lines.append(f'{name}_bucket{self._labels(labels + (("le", bound),))} {cumulative}')
+                    cumulative += counts.get(len(buckets), 0)
+                    lines.append(f'{name}_bucket{self._labels(labels + (("le", "+Inf"),))} {cumulative}')
+                    lines.append(f'{name}_sum{self._labels(labels)} {sums.get(labels, 0)}')
+                    lines.append(f'{name}_count{self._labels(labels)} {cumulative}')
+            else:
+                for labels, value in samples.get(name, {}).items():
+                    lines.append(f'{name}{self._labels(labels)} {value}')
+        return '\n'.join(lines) + '\n'
+
+
+class AccessLog:
+    """Structured (JSON lines) access log written by a background thread
+
+    Request handlers only append a tuple to a deque - no lock, no formatting,
+    no I/O. The writer thread formats everything queued since its last pass
+    and writes it out in a single call, so a burst of requests costs one write.
+    When the writer can't keep up, the oldest queued entries are dropped.
+    """
+
+    def __init__(self, settings=None, stream=None):
+        self._pending = collections.deque(maxlen=ACCESS_LOG_QUEUE_SIZE)
+        self._stream = stream
+        self._owns_stream = False
+        self._stop = threading.Event()
+        self._thread = None
+        self.configure(settings or {})
+
+    def configure(self, settings):
+        """Apply the log settings of the config's server block"""
+        level = settings.get('log_level', 'info')
+        if level not in LOG_LEVELS:
+            print(f"⚠️  Unknown log_level '{level}', using 'info'")
+            level = 'info'
+        self.level = LOG_LEVELS[level]
+        self.sample = float(settings.get('access_log_sample', 1.0))
+        path = settings.get('access_log')
+        if path != getattr(self, 'path', None) or self._stream is None:
+            self.path = path
+            self._open(path)
+
+    def _open(self, path):
+        old, owned = self._stream, self._owns_stream
+        try:
+            self._stream = open(path, 'a', buffering=1024 * 1024) if path else sys.stderr
+            self._owns_stream = bool(path)
+        except OSError as e:
+            print(f"❌ Cannot open access log {path}: {e}")
+            self._stream, self._owns_stream = sys.stderr, False
+        if owned and old is not None and old is not self._stream:
+            old.close()
+
+    def start(self):
+        self._thread = threading.Thread(target=self._run, name='access-log', daemon=True)
+        self._thread.start()
+
+    def close(self):
+        self._stop.set()
+        if self._thread is not None:
+            self._thread.join(timeout=RELAY_RETRY_SECONDS)
+        self._flush()
+        if self._owns_stream:
+            self._stream.close()
+
+    def log(self, level, record):
+        """Queue one record (a dict) at a level name, subject to level and sampling"""
+        severity = LOG_LEVELS[level]
+        if severity < self.level:
+            return
+        # Sampling thins out routine traffic; warnings and errors are always kept
+        if severity <= LOG_LEVELS['info'] and self.sample < 1.0 and random.random() >= self.sample:
+            return
+        if len(self._pending) == self._pending.maxlen:
+            METRICS.inc('streamserver_access_log_dropped_total')
+        self._pending.append((time.time(), level, record))
+
+    def _run(self):
+        while not self._stop.wait(ACCESS_LOG_FLUSH_SECONDS):
+            self._flush()
+
+    def _flush(self):
+        pending = self._pending
+        lines = []
+        while pending:
+            timestamp, level, record = pending.popleft()
+            stamp = time.strftime('%Y-%m-%dT%H:%M:%S', time.localtime(timestamp))
+            lines.append(json.dumps({'ts': f'{stamp}.{int(timestamp % 1 * 1000):03d}',
+                                     'level': level, **record}) + '\n')
+        if not lines:
+            return
+        try:
+            self._stream.write(''.join(lines))
+            self._stream.flush()
+        except (OSError, ValueError):
+            pass
+
+
+METRICS = Metrics()
+METRICS.describe('streamserver_upstream_bytes_total', 'counter', 'Bytes received from upstream cameras')
+METRICS.describe('streamserver_upstream_frames_total', 'counter', 'Frames received from upstream cameras')
+METRICS.describe('streamserver_upstream_reconnects_total', 'counter', 'Upstream reconnection attempts')
+METRICS.describe('streamserver_upstream_up', 'gauge', 'Whether the upstream camera is online')
+METRICS.describe('streamserver_upstream_fps', 'gauge', 'Upstream frame rate over the recent window')
+METRICS.describe('streamserver_frame_size_bytes', 'histogram', 'Size of upstream frames',
+                 buckets=(8e3, 16e3, 32e3, 64e3, 128e3, 256e3, 512e3, 1e6, 2e6))
+METRICS.describe('streamserver_relay_frames_sent_total', 'counter', 'Frames sent to relay viewers')
+METRICS.describe('streamserver_relay_bytes_sent_total', 'counter', 'Bytes sent to relay viewers')
+METRICS.describe('streamserver_relay_subscribers', 'gauge', 'Connected relay viewers')
+METRICS.describe('streamserver_relay_buffer_bytes', 'gauge', 'Bytes of frames buffered in a relay ring')
+METRICS.describe('streamserver_memory_used_bytes', 'gauge', 'Bytes of frames buffered across all relay rings')
+METRICS.describe('streamserver_memory_limit_bytes', 'gauge', 'Cap on bytes of frames buffered across all relay rings')
+METRICS.describe('streamserver_upstream_backpressure_seconds_total', 'counter',
+                 'Time upstream reads were paused because the memory limit was reached')
+METRICS.describe('streamserver_relay_dropped_frames_total', 'counter',
+                 'Frames skipped because a viewer had not taken the previous one in time')
+METRICS.describe('streamserver_relay_client_dropped_frames', 'gauge',
+                 'Frames skipped so far for each connected viewer')
+METRICS.describe('streamserver_recording_active', 'gauge', 'Whether a stream is being recorded to disk')
+METRICS.describe('streamserver_recording_bytes_written_total', 'counter', 'Bytes of recordings written to disk')
+METRICS.describe('streamserver_recording_dropped_frames_total', 'counter',
+                 'Recorded frames dropped because the disk writer fell behind')
+METRICS.describe('streamserver_motion_score', 'gauge', 'Fraction of the picture that changed in the last sample')
+METRICS.describe('streamserver_motion_active', 'gauge', 'Whether motion is currently detected')
+METRICS.describe('streamserver_motion_events_total', 'counter', 'Times motion started')
+METRICS.describe('streamserver_transcode_running', 'gauge', 'Whether the H.264 encoder is running')
+METRICS.describe('streamserver_transcode_fragments_total', 'counter', 'Fragmented MP4 segments encoded')
+METRICS.describe('streamserver_transcode_bytes_total', 'counter', 'Bytes of H.264 video encoded')
+METRICS.describe('streamserver_webrtc_peers', 'gauge', 'Connected WebRTC viewers')
+METRICS.describe('streamserver_peer_up', 'gauge', 'Whether a peer server answered its last stream listing')
+METRICS.describe('streamserver_peer_streams', 'gauge', 'Streams relayed from a peer server')
+METRICS.describe('streamserver_access_log_dropped_total', 'counter',
+                 'Access log entries dropped because the writer fell behind')
+METRICS.describe('streamserver_requests_total', 'counter', 'HTTP requests by route and status')
+METRICS.describe('streamserver_request_duration_seconds', 'histogram',
+                 'Time to serve non-streaming HTTP requests',
+                 buckets=(0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5))
+METRICS.describe('streamserver_frame_latency_seconds', 'histogram',
+                 'Age of a frame at each hop: upstream (camera to relay), relay (to the viewer socket), '
+                 'browser (to decoded in a page) and glass (capture to decoded in a page)',
+                 buckets=(0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10))
+
+
+def observe_latency(labels, hop, seconds):
+    """Record a frame's age at a hop, ignoring samples skewed clocks make meaningless"""
+    # Callers pass constant hops; record_latency only takes LATENCY_PAGE_HOPS from a page
+    assert hop in LATENCY_HOPS, hop
+    if 0 <= seconds <= LATENCY_MAX_SECONDS:
+        METRICS.observe('streamserver_frame_latency_seconds', labels + (('hop', hop),), seconds)
+
+
+class Frame:
+    """An immutable relayed JPEG with its multipart part header built once
+
+    Every viewer sends the same three buffers (header, JPEG, trailer), so the
+    per-viewer cost is a single scatter-gather syscall rather than a copy of
+    the frame into a freshly concatenated bytes object. The part header stamps
+    the frame with its sequence number, the time it reached this server and,
+    when the camera stamped it, the time it was captured.
+    """
+
+    __slots__ = ('seq', 'jpeg', 'timestamp', 'captured', 'part_header', 'buffers')
+
+    def __init__(self, seq, jpeg, timestamp, captured=None):
+        self.seq = seq
+        self.jpeg = jpeg
+        self.timestamp = timestamp
+        self.captured = captured
+        capture_header = f'X-Capture-Timestamp: {captured:.6f}\r\n' if captured is not None else ''
+        self.part_header = (f'--{RELAY_BOUNDARY}\r\nContent-Type: image/jpeg\r\n'
+                            f'Content-Length: {len(jpeg)}\r\n'
+                            f'X-Timestamp: {timestamp:.6f}\r\nX-Sequence: {seq}\r\n'
+                            f'{capture_header}\r\n').encode()
+        self.buffers = (self.part_header, jpeg, PART_TRAILER)
+
+
+def send_buffers(sock, buffers):
+    """Write a sequence of buffers with sendmsg, resuming after partial sends"""
+    if not hasattr(sock, 'sendmsg'):
+        for buffer in buffers:
+            sock.sendall(buffer)
+        return
+    pending = list(buffers)
+    while pending:
+        sent = sock.sendmsg(pending)
+        while sent:
+            first = len(pending[0])
+            if sent >= first:
+                sent -= first
+                pending.pop(0)
+            else:
+                # memoryview slicing resumes mid-buffer without copying it
+                pending[0] = memoryview(pending[0])[sent:]
+                sent = 0
+
+
+async def send_buffers_async(loop, sock, buffers):
+    """send_buffers for a non-blocking socket on an event loop"""
+    try:
+        sent = sock.sendmsg(buffers) if hasattr(sock, 'sendmsg') else 0
+    except BlockingIOError:
+        sent = 0
+    rest = []
+    for buffer in buffers:
+        if sent >= len(buffer):
+            sent -= len(buffer)
+        else:
+            rest.append(memoryview(buffer)[sent:])
+            sent = 0
+    # The socket buffer is full: let the loop wait for room and send the remainder,
+    # straight from the frame's own memory rather than a joined copy
+    for view in rest:
+        await loop.sock_sendall(sock, view)
+
+
+class MemoryBudget:
+    """Bytes of frames buffered by every relay ring, against a process-wide cap
+
+    While the cap is exceeded rings keep only their newest frame, and upstream
+    readers pause so TCP flow control slows the cameras down instead of memory
+    growing.
+    """
+
+    def __init__(self, limit):
+        self.limit = limit
+        self.used = 0
+        self._lock = threading.Lock()
+        self._warned = False
+
+    @property
+    def exhausted(self):
+        return self.used >= self.limit
+
+    def charge(self, size):
+        with self._lock:
+            self.used += size
+        if self.exhausted and not self._warned:
+            self._warned = True
+            print(f"⚠️  Relay frame buffers reached the {self.limit / (1024 * 1024):g} MB memory limit, "
+                  "slowing upstream reads")
+
+    def refund(self, size):
+        with self._lock:
+            self.used -= size
+        if self._warned and self.used < self.limit / 2:
+            self._warned = False
+
+
+class FrameRing:
+    """Ring of the most recent JPEG frames shared by all subscribers
+
+    Bounded by frame count and by bytes, so a camera sending huge frames can't
+    hold more than its share of memory; the newest frame is always kept.
+    """
+
+    def __init__(self, size=RELAY_RING_SIZE, max_bytes=RELAY_BUFFER_MB * 1024 * 1024, memory=None):
+        self._frames = collections.deque()
+        self._cond = threading.Condition()
+        self.size = size
+        self.max_bytes = max_bytes
+        self.memory = memory
+        self.bytes = 0
+        self.seq = 0
+
+    def publish(self, jpeg, captured=None, timestamp=None):
+        """Wrap a JPEG in a Frame, append it and wake every waiting subscriber"""
+        with self._cond:
+            self.seq += 1
+            frame = Frame(self.seq, jpeg, time.time() if timestamp is None else timestamp, captured)
+            self._frames.append(frame)
+            self.bytes += len(jpeg)
+            if self.memory is not None:
+                self.memory.charge(len(jpeg))
+            exhausted = self.memory is not None and self.memory.exhausted
+            self._trim(1 if exhausted else self.size)
+            self._cond.notify_all()
+        return frame
+
+    def trim(self, keep=1):
+        """Drop all but the newest `keep` frames"""
+        with self._cond:
+            self._trim(keep)
+
+    def clear(self):
+        """Drop every frame, returning their bytes to the memory budget"""
+        with self._cond:
+            self._trim(0)
+
+    def _trim(self, keep):
+        frames = self._frames
+        freed = 0
+        while frames and (len(frames) > keep or (len(frames) > 1 and self.bytes - freed > self.max_bytes)):
+            freed += len(frames.popleft().jpeg)
+        if freed:
+            self.bytes -= freed
+            if self.memory is not None:
+                self.memory.refund(freed)
+
+    def latest(self):
+        """Return the newest buffered Frame, or None before the first frame"""
+        with self._cond:
+            return self._frames[-1] if self._frames else None
+
+    def wait_newer(self, seq, timeout):
+        """Wait for a frame newer than seq; the newest frame, or None on timeout"""
+        with self._cond:
+            if not self._cond.wait_for(lambda: self.seq > seq, timeout):
+                return None
+            return self._frames[-1]
+
+
+class SharedFrameRing:
+    """Newest frames of one relay in shared memory, written by the ingest process
+
+    Worker processes map the same block and copy out the latest frame when
+    woken. Each slot is guarded like a seqlock: the writer zeroes the slot's
+    sequence number, copies the JPEG, then stamps it, so a reader that sees
+    the same number before and after copying knows it didn't race a write.
+    """
+
+    def __init__(self, memory, slot_size, notify=None):
+        self.memory = memory
+        self.name = memory.name
+        self.slot_size = slot_size
+        self.notify = notify
+        self.seq = 0
+        self._stride = SHARED_SLOT_HEADER.size + slot_size
+        self._warned = False
+
+    @classmethod
+    def create(cls, slot_size, notify=None):
+        size = SHARED_RING_HEADER.size + SHARED_RING_SLOTS * (SHARED_SLOT_HEADER.size + slot_size)
+        memory = shared_memory.SharedMemory(create=True, size=size)
+        SHARED_RING_HEADER.pack_into(memory.buf, 0, 0, slot_size)
+        return cls(memory, slot_size, notify)
+
+    @classmethod
+    def attach(cls, name):
+        memory = shared_memory.SharedMemory(name=name)
+        _, slot_size = SHARED_RING_HEADER.unpack_from(memory.buf, 0)
+        return cls(memory, slot_size)
+
+    def _offset(self, seq):
+        return SHARED_RING_HEADER.size + seq % SHARED_RING_SLOTS * self._stride
+
+    def publish(self, frame):
+        """Copy a Frame into the next slot and wake the workers; only the ingest process calls this"""
+        size = len(frame.jpeg)
+        if size > self.slot_size:
+            if not self._warned:
+                print(f"⚠️  {size}-byte frame is too big for shared memory; raise stream_buffer_mb")
+                self._warned = True
+            return
+        self.seq += 1
+        buf = self.memory.buf
+        offset = self._offset(self.seq)
+        start = offset + SHARED_SLOT_HEADER.size
+        SHARED_SLOT_HEADER.pack_into(buf, offset, 0, 0.0, 0.0, 0)
+        buf[start:start + size] = frame.jpeg
+        captured = math.nan if frame.captured is None else frame.captured
+        SHARED_SLOT_HEADER.pack_into(buf, offset, self.seq, frame.timestamp, captured, size)
+        SHARED_RING_HEADER.pack_into(buf, 0, self.seq, self.slot_size)
+        if self.notify is not None:
+            self.notify()
+
+    def read(self, after):
+        """(seq, jpeg, timestamp, captured) of the newest frame if newer than `after`, else None"""
+        buf = self.memory.buf
+        seq, _ = SHARED_RING_HEADER.unpack_from(buf, 0)
+        if seq <= after:
+            return None
+        offset = self._offset(seq)
+        slot_seq, timestamp, captured, size = SHARED_SLOT_HEADER.unpack_from(buf, offset)
+        if slot_seq != seq:
+            # Overwritten already; the writer's wake-up for the newer frame is on its way
+            return None
+        start = offset + SHARED_SLOT_HEADER.size
+        jpeg = bytes(buf[start:start + size])
+        if SHARED_SLOT_HEADER.unpack_from(buf, offset)[0] != seq:
+            return None
+        return seq, jpeg, timestamp, None if math.isnan(captured) else captured
+
+    def close(self):
+        try:
+            self.memory.close()
+        except BufferError:
+            pass
+
+    def unlink(self):
+        self.close()
+        try:
+            self.memory.unlink()
+        except FileNotFoundError:
+            pass
+
+
+class Subscriber:
+    """One viewer's latest-frame-wins slot
+
+    The relay overwrites the slot with every new frame, so a viewer that can't
+    keep up simply skips frames instead of queueing them. An optional max_fps
+    caps how often the viewer is handed a frame at all.
+    """
+
+    def __init__(self, max_fps=None, client=None):
+        self.client = client
+        self._cond = threading.Condition()
+        self._frame = None
+        self._closed = False
+        self._interval = 1.0 / max_fps if max_fps else 0.0
+        self._next_due = 0.0
+        self.dropped = 0
+
+    def offer(self, frame):
+        """Replace the pending frame, counting the old one as dropped if it was due but unsent"""
+        with self._cond:
+            # Before _next_due the ?fps= cap is skipping frames on purpose, not the viewer
+            if self._frame is not None and (not self._interval or time.monotonic() >= self._next_due):
+                self.dropped += 1
+            self._frame = frame
+            self._cond.notify()
+
+    def close(self):
+        with self._cond:
+            self._closed = True
+            self._cond.notify()
+
+    def get(self, timeout=None):
+        """Wait for the next frame due to this viewer; None on timeout or close"""
+        if self._interval:
+            delay = self._next_due - time.monotonic()
+            if delay > 0:
+                # Frames arriving meanwhile overwrite the slot and are skipped
+                time.sleep(delay)
+        with self._cond:
+            if not self._cond.wait_for(lambda: self._frame is not None or self._closed, timeout):
+                return None
+            frame, self._frame = self._frame, None
+        if self._interval:
+            self._next_due = max(self._next_due + self._interval, time.monotonic())
+        return frame
+
+    @property
+    def closed(self):
+        return self._closed
+
+
+class AsyncSubscriber(Subscriber):
+    """A Subscriber read by a coroutine on the RelayLoop instead of by a thread"""
+
+    def __init__(self, relay_loop, max_fps=None, client=None):
+        super().__init__(max_fps, client)
+        self._relay_loop = relay_loop
+        # Created on the loop itself; Python 3.9 binds an Event to a loop at construction
+        self._ready = None
+
+    def offer(self, frame):
+        super().offer(frame)
+        self._relay_loop.call(self._wake)
+
+    def close(self):
+        super().close()
+        self._relay_loop.call(self._wake)
+
+    def _wake(self):
+        if self._ready is not None:
+            self._ready.set()
+
+    async def next(self):
+        """Wait for the next frame due to this viewer; None once closed"""
+        if self._interval:
+            delay = self._next_due - time.monotonic()
+            if delay > 0:
+                await asyncio.sleep(delay)
+        if self._ready is None:
+            self._ready = asyncio.Event()
+        while True:
+            with self._cond:
+                if self._frame is not None or self._closed:
+                    frame, self._frame = self._frame, None
+                    break
+                self._ready.clear()
+            await self._ready.wait()
+        if frame is not None and self._interval:
+            self._next_due = max(self._next_due + self._interval, time.monotonic())
+        return frame
+
+
+class MJPEGParser:
+    """Incremental splitter for MJPEG byte streams
+
+    Bytes accumulate in one bytearray and every search resumes where the
+    previous one stopped, so each byte is scanned at most once. Parts with a
+    Content-Length (picamera2, mjpg-streamer, Motion) are sliced out without
+    looking at their payload at all; parts without one are cut at the next
+    boundary, or for a bare concatenation of JPEGs at the JPEG end marker.
+    Boundary spelling is not trusted: servers disagree on leading dashes and
+    quoting, so part headers are recognised by their blank-line terminator.
+    X-Timestamp and X-Capture-Timestamp part headers (mjpg-streamer, a peer
+    server's relay) are picked up for latency tracing.
+    """
+
+    SOI = b'\xff\xd8'
+    EOI = b'\xff\xd9'
+
+    _HEADERS, _BODY, _SCAN = range(3)
+
+    def __init__(self, boundary=None):
+        self._buffer = bytearray()
+        self._state = self._HEADERS
+        self._scan_from = 0
+        self._length = None
+        self._sent = self._captured = None
+        # Cutting at the boundary is robust against EXIF thumbnails, whose own
+        # end marker would otherwise end the frame early
+        self._delimiter = b'--' + boundary.lstrip('-').encode() if boundary else None
+
+    @classmethod
+    def for_content_type(cls, content_type):
+        """Build a parser for an upstream response's Content-Type header"""
+        boundary = None
+        for param in (content_type or '').split(';')[1:]:
+            name, _, value = param.strip().partition('=')
+            if name.lower() == 'boundary':
+                boundary = value.strip().strip('"') or None
+        return cls(boundary)
+
+    def feed(self, chunk):
+        """Consume a chunk of upstream bytes and return any complete frames"""
+        return [jpeg for jpeg, _, _ in self.feed_parts(chunk)]
+
+    def feed_parts(self, chunk):
+        """Like feed, but as (jpeg, sent, captured) with the part's timestamps or None"""
+        buffer = self._buffer
+        buffer += chunk
+        frames = []
+        while True:
+            if self._state == self._HEADERS:
+                if not self._parse_headers():
+                    break
+            elif self._state == self._BODY:
+                end = self._length
+                if len(buffer) < end:
+                    break
+                if buffer.startswith(self.SOI):
+                    frames.append((bytes(buffer[:end]), self._sent, self._captured))
+                    self._consume(end)
+                else:
+                    # Content-Length lied; fall back to scanning for the end
+                    self._state, self._scan_from = self._SCAN, 2
+            else:
+                end = self._find_end()
+                if end < 0:
+                    break
+                frames.append((bytes(buffer[:end]), self._sent, self._captured))
+                self._consume(end)
+
+        # Every break above waits for more data, so this is where a part grows
+        if len(buffer) > RELAY_MAX_FRAME_SIZE:
+            # Runaway part without a recognisable end: resynchronise
+            buffer.clear()
+            self._consume(0)
+        return frames
+
+    def _consume(self, end):
+        # Deleting from the front of a bytearray only moves its start pointer
+        del self._buffer[:end]
+        self._state, self._scan_from, self._length = self._HEADERS, 0, None
+        self._sent = self._captured = None
+
+    def _parse_headers(self):
+        """Skip to the next part body; False if more data is needed"""
+        buffer = self._buffer
+        soi = buffer.find(self.SOI, self._scan_from)
+        terminator = buffer.find(b'\r\n\r\n', self._scan_from)
+        if terminator >= 0 and (soi < 0 or terminator < soi):
+            headers = bytes(buffer[:terminator])
+            del buffer[:terminator + 4]
+            self._scan_from = 0
+            self._length = None
+            for line in headers.split(b'\r\n'):
+                name, _, value = line.partition(b':')
+                name = name.strip().lower()
+                try:
+                    if name == b'content-length':
+                        # Motion pads the value with spaces
+                        length = int(value.strip())
+                        # An impossible length is ignored and the part cut at its end marker instead
+                        self._length = length if 0 <= length <= RELAY_MAX_FRAME_SIZE else None
+                    elif name == b'x-timestamp':
+                        self._sent = float(value)
+                    elif name == b'x-capture-timestamp':
+                        self._captured = float(value)
+                except ValueError:
+                    pass
+            if self._captured is None:
+                # A camera's own stamp is the capture time; a peer passes the camera's on
+                self._captured = self._sent
+            if self._length is not None:
+                self._state = self._BODY
+            return True
+        if soi >= 0:
+            # JPEG data without (further) headers
+            del buffer[:soi]
+            self._state, self._scan_from = self._SCAN, 2
+            return True
+        # Keep the last bytes: they may be the start of a split marker
+        self._scan_from = max(len(buffer) - 3, 0)
+        return False
+
+    def _find_end(self):
+        """Offset just past the current frame in scan mode, or -1"""
+        buffer = self._buffer
+        if self._delimiter is not None:
+            index = buffer.find(self._delimiter, self._scan_from)
+            if index >= 0:
+                end = buffer.rfind(self.EOI, 0, index)
+                return end + 2 if end >= 0 else index
+            self._scan_from = max(len(buffer) - len(self._delimiter) + 1, 2)
+            return -1
+        index = buffer.find(self.EOI, self._scan_from)
+        if index >= 0:
+            return index + 2
+        self._scan_from = max(len(buffer) - 1, 2)
+        return -1
+
+
+class StreamHealth:
+    """Upstream connection state of one relay, with exponential backoff and jitter"""
+
+    def __init__(self, on_change=None):
+        self._lock = threading.Lock()
+        self._on_change = on_change
+        self.status = 'connecting'
+        self.since = time.time()
+        self.failures = 0
+        self.last_error = None
+        self.next_retry = None
+        self.last_frame = None
+        self._frame_times = collections.deque(maxlen=RELAY_FPS_WINDOW)
+
+    def _set_status(self, status):
+        """Change status under the lock; returns True if it actually changed"""
+        if status == self.status:
+            return False
+        self.status = status
+        self.since = time.time()
+        return True
+
+    def _changed(self):
+        # Called outside the lock, since listeners read snapshot()
+        if self._on_change is not None:
+            self._on_change(self)
+
+    def frame(self, size, count=1):
+        """Record received frames; the first one marks the stream online
+
+        A remuxed H.264 stream reports a whole fragment of `count` frames at once.
+        """
+        now = time.time()
+        with self._lock:
+            self.last_frame = now
+            self._frame_times.append((now, size, count))
+            if self.status == 'online':
+                return
+            self._set_status('online')
+            self.failures = 0
+            self.last_error = None
+            self.next_retry = None
+        self._changed()
+
+    def failed(self, error):
+        """Record a failed or lost connection and return how long to wait before retrying"""
+        with self._lock:
+            self.failures += 1
+            self.last_error = str(error)
+            # Doubling backoff, randomized within its upper half so that
+            # several relays of a rebooting Pi don't retry in lockstep
+            ceiling = min(RELAY_BACKOFF_MAX, RELAY_BACKOFF_BASE * 2 ** (self.failures - 1))
+            delay = random.uniform(ceiling / 2, ceiling)
+            self.next_retry = time.time() + delay
+            self._set_status('offline')
+            self._frame_times.clear()
+        # Published on every failure, not just the transition, for the new retry time
+        self._changed()
+        return delay
+
+    def idle(self):
+        """Record that the upstream was disconnected because nobody is watching"""
+        with self._lock:
+            self.next_retry = None
+            self._frame_times.clear()
+            if not self._set_status('idle'):
+                return
+        self._changed()
+
+    def connecting(self):
+        with self._lock:
+            self.next_retry = None
+            if self.status == 'offline' or not self._set_status('connecting'):
+                return
+        self._changed()
+
+    def mirror(self, snapshot):
+        """Adopt the state another process reported for the same upstream"""
+        with self._lock:
+            self._set_status(snapshot['status'])
+            self.since = snapshot['since']
+            self.failures = snapshot['failures']
+            self.last_error = snapshot['error']
+            retry_in = snapshot['retry_in']
+            self.next_retry = None if retry_in is None else time.time() + retry_in
+
+    def rates(self):
+        """Return (frames per second, kilobits per second) over the recent window"""
+        with self._lock:
+            samples = list(self._frame_times)
+        if len(samples) < 2 or time.time() - samples[-1][0] > RELAY_STALL_SECONDS:
+            return 0.0, 0.0
+        elapsed = samples[-1][0] - samples[0][0]
+        if elapsed <= 0:
+            return 0.0, 0.0
+        # The first sample only opens the window, so its frames aren't counted
+        size = sum(frame_size for _, frame_size, _ in samples[1:])
+        frames = sum(count for _, _, count in samples[1:])
+        return frames / elapsed, size * 8 / 1000 / elapsed
+
+    @property
+    def fps(self):
+        return self.rates()[0]
+
+    def snapshot(self):
+        """JSON-friendly view of the current state"""
+        fps, kbps = self.rates()
+        with self._lock:
+            now = time.time()
+            return {
+                'status': self.status,
+                'since': self.since,
+                'fps': round(fps, 1),
+                'kbps': round(kbps),
+                'last_frame': self.last_frame,
+                'failures': self.failures,
+                'error': self.last_error,
+                'retry_in': max(self.next_retry - now, 0) if self.next_retry else None,
+            }
+
+
+class FrameSource:
+    """Fans frames out to viewers through their latest-frame-wins slots"""
+
+    def __init__(self, memory=None, buffer_bytes=RELAY_BUFFER_MB * 1024 * 1024):
+        self.ring = FrameRing(max_bytes=buffer_bytes, memory=memory)
+        self._subscribers = ()
+        self._subscribers_lock = threading.Lock()
+        self._stop = threading.Event()
+
+    def _publish(self, jpeg, captured=None, timestamp=None):
+        frame = self.ring.publish(jpeg, captured, timestamp)
+        for subscriber in self._subscribers:
+            subscriber.offer(frame)
+        return frame
+
+    def _close_subscribers(self):
+        with self._subscribers_lock:
+            subscribers, self._subscribers = self._subscribers, ()
+        for subscriber in subscribers:
+            subscriber.close()
+
+    @property
+    def subscriber_count(self):
+        return len(self._subscribers)
+
+    def subscribe(self, max_fps=None, client=None, relay_loop=None):
+        """Register a viewer, primed with the newest buffered frame if it's still current
+
+        A reconnecting viewer thus picks up at the current frame of the shared
+        upstream session rather than waiting for the next one, but is never
+        shown a picture left over from before the relay went idle. Viewers
+        served by the relay loop get an AsyncSubscriber.
+        """
+        if relay_loop is not None:
+            subscriber = AsyncSubscriber(relay_loop, max_fps, client)
+        else:
+            subscriber = Subscriber(max_fps, client)
+        latest = self.ring.latest()
+        if latest is not None and time.time() - latest.timestamp < RELAY_STALL_SECONDS:
+            subscriber.offer(latest)
+        with self._subscribers_lock:
+            if self._stop.is_set():
+                subscriber.close()
+            else:
+                # Copy-on-write so the publish path iterates without locking
+                self._subscribers = self._subscribers + (subscriber,)
+        return subscriber
+
+    def unsubscribe(self, subscriber):
+        """Remove a viewer; False if it was already gone"""
+        with self._subscribers_lock:
+            subscribers = tuple(s for s in self._subscribers if s is not subscriber)
+            removed = len(subscribers) != len(self._subscribers)
+            self._subscribers = subscribers
+        subscriber.close()
+        if removed and subscriber.dropped:
+            METRICS.inc('streamserver_relay_dropped_frames_total', self.tier_labels, subscriber.dropped)
+        return removed
+
+    def subscribers(self):
+        return self._subscribers
+
+
+async def open_http_stream(url, timeout):
+    """GET url on the running event loop; (reader, writer, headers) of its 200 response
+
+    The request is HTTP/1.0, so the body arrives unchunked and ends when the
+    server closes the connection. Redirects are followed.
+    """
+    for _ in range(RELAY_MAX_REDIRECTS + 1):
+        parts = urlparse(url)
+        if parts.scheme not in ('http', 'https'):
+            raise ValueError(f'unsupported URL: {url}')
+        port = parts.port or (443 if parts.scheme == 'https' else 80)
+        reader, writer = await asyncio.wait_for(
+            asyncio.open_connection(parts.hostname, port, ssl=parts.scheme == 'https' or None,
+                                    limit=2 * RELAY_CHUNK_SIZE), timeout)
+        try:
+            target = (parts.path or '/') + (f'?{parts.query}' if parts.query else '')
+            writer.write(f'GET {target} HTTP/1.0\r\nHost: {parts.netloc.rpartition("@")[2]}\r\n'
+                         f'User-Agent: streamserverclient\r\nAccept: */*\r\n\r\n'.encode('latin-1'))
+            head = await asyncio.wait_for(reader.readuntil(b'\r\n\r\n'), timeout)
+            status_line, _, header_block = head.partition(b'\r\n')
+            _, status, reason = (status_line.decode('latin-1').split(' ', 2) + ['', ''])[:3]
+            headers = http.client.parse_headers(io.BytesIO(header_block))
+            if status in ('301', '302', '303', '307', '308') and headers.get('Location'):
+                url = urljoin(url, headers['Location'])
+                writer.close()
+                continue
+            if status != '200':
+                raise ConnectionError(f'HTTP Error {status}: {reason.strip()}')
+            return reader, writer, headers
+        except BaseException:
+            writer.close()
+            raise
+    raise ConnectionError('too many redirects')
+
+
+class RelayLoop(threading.Thread):
+    """The event loop that every MJPEG upstream reader and relay viewer runs on
+
+    A single thread multiplexes all cameras and viewers, instead of one thread
+    (with its stack and context switches) each. uvloop is used when installed.
+    """
+
+    def __init__(self, name='relay-loop'):
+        super().__init__(name=name, daemon=True)
+        self.loop = uvloop.new_event_loop() if uvloop is not None else asyncio.new_event_loop()
+
+    def run(self):
+        asyncio.set_event_loop(self.loop)
+        self.loop.run_forever()
+
+    def stop(self):
+        """Cancel every upstream reader and viewer, then stop the loop"""
+        if not self.is_alive():
+            return
+        try:
+            self.submit(self._cancel_all()).result(timeout=RELAY_RETRY_SECONDS)
+        except Exception:
+            pass
+        self.loop.call_soon_threadsafe(self.loop.stop)
+
+    async def _cancel_all(self):
+        tasks = [task for task in asyncio.all_tasks() if task is not asyncio.current_task()]
+        for task in tasks:
+            task.cancel()
+        await asyncio.gather(*tasks, return_exceptions=True)
+
+    def submit(self, coroutine):
+        """Schedule a coroutine from any thread; returns a concurrent Future"""
+        return asyncio.run_coroutine_threadsafe(coroutine, self.loop)
+
+    def call(self, callback):
+        """Run callback on the loop: right away when already on it, else as soon as possible"""
+        if threading.get_ident() == self.ident:
+            callback()
+            return
+        try:
+            self.loop.call_soon_threadsafe(callback)
+        except RuntimeError:
+            # The loop has already shut down
+            pass
+
+    def serve_viewer(self, handler, source, subscriber):
+        """Take over a relay response whose headers the handler has sent"""
+        self.submit(self._serve_viewer(handler, source, subscriber))
+
+    async def _serve_viewer(self, handler, source, subscriber):
+        sock = handler.connection
+        fd = sock.fileno()
+
+        def readable():
+            # The viewer never sends anything, so readability means it hung up
+            try:
+                if not sock.recv(4096):
+                    subscriber.close()
+            except BlockingIOError:
+                pass
+            except OSError:
+                subscriber.close()
+
+        self.loop.add_reader(fd, readable)
+        labels = source.tier_labels
+        try:
+            while not subscriber.closed:
+                frame = await subscriber.next()
+                if frame is None:
+                    continue
+                await send_buffers_async(self.loop, sock, frame.buffers)
+                METRICS.inc('streamserver_relay_frames_sent_total', labels)
+                METRICS.inc('streamserver_relay_bytes_sent_total', labels, len(frame.jpeg))
+                observe_latency(labels, 'relay', time.time() - frame.timestamp)
+        except OSError:
+            pass
+        finally:
+            self.loop.remove_reader(fd)
+            source.unsubscribe(subscriber)
+            handler.finish_detached()
+
+
+class StreamRelay(FrameSource):
+    """Single upstream connection to a Pi camera fanned out to many viewers
+
+    The connection is reference-counted: it is opened for the first
+    subscriber and closed once linger_seconds have passed without one.
+    Recording and motion detection need every frame, so hub marks those
+    relays always_on. MJPEG upstreams are read by a coroutine on the shared
+    RelayLoop; H.264 ones by ffmpeg, supervised from a thread.
+    """
+
+    def __init__(self, stream_id, url, settings=None, events=None, stream_format='mjpeg',
+                 relay_loop=None, memory=None):
+        settings = settings or {}
+        super().__init__(memory, int(settings.get('stream_buffer_mb', RELAY_BUFFER_MB) * 1024 * 1024))
+        self.stream_id = stream_id
+        self.url = url
+        if stream_format not in STREAM_FORMATS:
+            print(f"⚠️  Unknown format '{stream_format}' for {stream_id}, assuming mjpeg")
+            stream_format = 'mjpeg'
+        self.format = stream_format
+        self.settings = settings
+        self.events = events
+        self.relay_loop = relay_loop
+        self.memory = memory
+        self.labels = (('stream', stream_id),)
+        self.tier_labels = self.labels + (('tier', 'full'),)
+        self.health = StreamHealth(on_change=self._health_changed)
+        self.recorder = None
+        self.transcoder = None
+        self.mirror = None
+        self.lazy = self.settings.get('lazy', True)
+        self.linger = self.settings.get('linger_seconds', RELAY_LINGER_SECONDS)
+        self.always_on = False
+        self._demand = 0
+        self._demand_until = 0.0
+        self._demand_cond = threading.Condition()
+        self._demand_event = None
+        self._thread = None
+        self._task = None
+        self._thumbnail = None
+        self._thumbnail_lock = threading.Lock()
+
+    @property
+    def passthrough(self):
+        """Whether the upstream is already H.264 and never has JPEG frames"""
+        return self.format != 'mjpeg'
+
+    def start(self):
+        """Start reading from upstream"""
+        if self.passthrough:
+            self._thread = threading.Thread(target=self._run_passthrough, name=f'relay-{self.stream_id}',
+                                            daemon=True)
+            self._thread.start()
+        else:
+            self._task = self.relay_loop.submit(self._run())
+
+    def stop(self):
+        """Stop reading from upstream and disconnect every viewer"""
+        self._stop.set()
+        with self._demand_cond:
+            self._notify_demand()
+        if self._task is not None:
+            self._task.cancel()
+        self._close_subscribers()
+        self.ring.clear()
+        if self._thumbnail is not None:
+            self._thumbnail.stop()
+        if self.recorder is not None:
+            self.recorder.stop()
+        if self.transcoder is not None:
+            self.transcoder.stop()
+        if self.mirror is not None:
+            self.relay_loop.call(self._unlink_mirror)
+
+    def _unlink_mirror(self):
+        # On the loop, so the ingest coroutine is never part-way through writing to it
+        mirror, self.mirror = self.mirror, None
+        if mirror is not None:
+            mirror.unlink()
+
+    @property
+    def recording(self):
+        recorder = self.recorder
+        return recorder is not None and recorder.active
+
+    def subscribe(self, max_fps=None, client=None, relay_loop=None):
+        self.acquire()
+        return super().subscribe(max_fps, client, relay_loop)
+
+    def unsubscribe(self, subscriber):
+        removed = super().unsubscribe(subscriber)
+        if removed:
+            self.release()
+        return removed
+
+    def acquire(self):
+        """Hold the upstream connection open until the matching release()"""
+        with self._demand_cond:
+            self._demand += 1
+            self._notify_demand()
+
+    def release(self):
+        with self._demand_cond:
+            self._demand -= 1
+            self._demand_until = max(self._demand_until, time.monotonic() + self.linger)
+
+    def prewarm(self):
+        """Connect now, so a viewer about to subscribe gets a frame straight away"""
+        with self._demand_cond:
+            self._demand_until = max(self._demand_until, time.monotonic() + self.linger)
+            self._notify_demand()
+
+    def set_always_on(self, always_on):
+        with self._demand_cond:
+            self.always_on = always_on
+            self._notify_demand()
+
+    def _notify_demand(self):
+        # Wakes whichever of the passthrough thread or the ingest coroutine is waiting
+        self._demand_cond.notify_all()
+        if self._task is not None:
+            self.relay_loop.call(self._wake_ingest)
+
+    def _wake_ingest(self):
+        if self._demand_event is not None:
+            self._demand_event.set()
+
+    def wanted(self):
+        """Whether the upstream connection should be open right now"""
+        return (not self.lazy or self.always_on or self._demand > 0
+                or time.monotonic() < self._demand_until)
+
+    def _wait_for_demand(self):
+        self.health.idle()
+        with self._demand_cond:
+            self._demand_cond.wait_for(lambda: self._stop.is_set() or self.wanted())
+
+    async def _await_demand(self):
+        self.health.idle()
+        # An idle relay keeps just its last frame
+        self.ring.trim(1)
+        while not self._stop.is_set() and not self.wanted():
+            self._demand_event.clear()
+            await self._demand_event.wait()
+
+    async def _backpressure(self):
+        """Leave the socket unread while the memory budget is exhausted, for a bounded time"""
+        started = time.monotonic()
+        deadline = started + RELAY_BACKPRESSURE_SECONDS
+        while self.memory.exhausted and not self._stop.is_set() and time.monotonic() < deadline:
+            await asyncio.sleep(RELAY_BACKPRESSURE_POLL)
+        METRICS.inc('streamserver_upstream_backpressure_seconds_total', self.labels, time.monotonic() - started)
+
+    def _health_changed(self, health):
+        if self.events is not None:
+            self.events.publish('status', {'stream': self.stream_id, **health.snapshot()})
+
+    def thumbnail(self):
+        """The shared downscaled tier of this stream, created on first use"""
+        if Image is None:
+            # Without Pillow there is no JPEG codec to scale with
+            return self
+        with self._thumbnail_lock:
+            if self._thumbnail is None:
+                self._thumbnail = ThumbnailRelay(self, self.settings.get('thumb_scale', 'auto'))
+            return self._thumbnail
+
+    async def _run(self):
+        labels = self.labels
+        self._demand_event = asyncio.Event()
+        while not self._stop.is_set():
+            if not self.wanted():
+                await self._await_demand()
+                continue
+            if self.health.failures:
+                METRICS.inc('streamserver_upstream_reconnects_total', labels)
+            self.health.connecting()
+            writer = None
+            try:
+                # The timeout doubles as stall detection: a silent upstream counts as lost
+                reader, writer, headers = await open_http_stream(self.url, RELAY_STALL_SECONDS)
+                print(f"🔗 Relay {self.stream_id} connected to {self.url}")
+                parser = MJPEGParser.for_content_type(headers.get('Content-Type'))
+                while not self._stop.is_set():
+                    if not self.wanted():
+                        print(f"💤 Relay {self.stream_id} idle, disconnecting")
+                        break
+                    if self.memory is not None and self.memory.exhausted:
+                        await self._backpressure()
+                    chunk = await asyncio.wait_for(reader.read(RELAY_CHUNK_SIZE), RELAY_STALL_SECONDS)
+                    if not chunk:
+                        break
+                    METRICS.inc('streamserver_upstream_bytes_total', labels, len(chunk))
+                    for jpeg, sent, captured in parser.feed_parts(chunk):
+                        METRICS.inc('streamserver_upstream_frames_total', labels)
+                        METRICS.observe('streamserver_frame_size_bytes', labels, len(jpeg))
+                        self.health.frame(len(jpeg))
+                        frame = self._publish(jpeg, captured)
+                        if sent is not None:
+                            observe_latency(self.tier_labels, 'upstream', frame.timestamp - sent)
+                        recorder = self.recorder
+                        if recorder is not None:
+                            recorder.add(frame)
+                        mirror = self.mirror
+                        if mirror is not None:
+                            mirror.publish(frame)
+                if not self.wanted():
+                    continue
+                error = 'upstream closed the connection'
+                print(f"⚠️  Relay {self.stream_id} upstream closed")
+            except Exception as e:
+                error = 'timed out' if isinstance(e, asyncio.TimeoutError) else e
+                if self.health.failures == 0:
+                    print(f"❌ Relay {self.stream_id} upstream error: {error}")
+            finally:
+                if writer is not None:
+                    writer.close()
+            if self._stop.is_set():
+                break
+            await asyncio.sleep(self.health.failed(error))
+
+    def _run_passthrough(self):
+        # ffmpeg owns the upstream connection; this loop only restarts it with backoff
+        while not self._stop.is_set():
+            if not self.wanted():
+                self._wait_for_demand()
+                continue
+            remuxer = self.transcoder
+            if remuxer is None:
+                error = 'ffmpeg is not installed'
+            else:
+                if self.health.failures:
+                    METRICS.inc('streamserver_upstream_reconnects_total', self.labels)
+                self.health.connecting()
+                error = remuxer.run()
+            if self._stop.is_set():
+                break
+            if error is None:
+                # Stopped for lack of viewers, not a failure
+                continue
+            self._stop.wait(self.health.failed(error))
+
+
+def downscale_jpeg(jpeg, scale, quality=THUMB_QUALITY):
+    """Shrink a JPEG by 1/2, 1/4 or 1/8 using libjpeg's DCT-domain scaling
+
+    Image.draft() makes the decoder skip the high-frequency DCT coefficients,
+    so only the reduced image is ever decoded - far cheaper than a full decode
+    followed by a resize.
+    """
+    image = Image.open(io.BytesIO(jpeg))
+    if scale == 'auto':
+        # Largest reduction that still fills a grid tile
+        scale = next((s for s in THUMB_SCALES if image.height // s >= THUMB_TARGET_HEIGHT), 1)
+    if scale > 1:
+        image.draft(image.mode, (image.width // scale, image.height // scale))
+    out = io.BytesIO()
+    image.save(out, 'JPEG', quality=quality)
+    return out.getvalue()
+
+
+class ThumbnailRelay(FrameSource):
+    """Downscaled copy of a relay, encoded once and shared by every grid viewer
+
+    The scaler thread runs only while someone is watching and reads the parent
+    relay through its own latest-frame-wins slot, so a slow encode skips frames
+    rather than delaying the full-resolution stream.
+    """
+
+    def __init__(self, relay, scale):
+        super().__init__(relay.memory, relay.ring.max_bytes)
+        self.relay = relay
+        self.labels = relay.labels
+        self.tier_labels = relay.labels + (('tier', 'thumb'),)
+        if scale != 'auto':
+            try:
+                scale = int(scale)
+            except (TypeError, ValueError):
+                pass
+            if scale not in THUMB_SCALES:
+                print(f"⚠️  Unsupported thumb_scale {scale} for {relay.stream_id}, using auto")
+                scale = 'auto'
+        self.scale = scale
+        self._thread = None
+        self._thread_lock = threading.Lock()
+
+    def subscribe(self, max_fps=None, client=None, relay_loop=None):
+        subscriber = super().subscribe(max_fps, client, relay_loop)
+        with self._thread_lock:
+            if self._thread is None or not self._thread.is_alive():
+                self._thread = threading.Thread(target=self._run, daemon=True,
+                                                name=f'thumb-{self.relay.stream_id}')
+                self._thread.start()
+        return subscriber
+
+    def stop(self):
+        self._stop.set()
+        self._close_subscribers()
+        self.ring.clear()
+
+    def _run(self):
+        source = self.relay.subscribe()
+        try:
+            while not self._stop.is_set() and not source.closed:
+                frame = source.get(timeout=THUMB_IDLE_SECONDS)
+                with self._thread_lock:
+                    if self.subscriber_count == 0:
+                        self._thread = None
+                        return
+                if frame is None:
+                    continue
+                try:
+                    # Keep the full frame's stamps so the thumb tier's latency includes scaling
+                    self._publish(downscale_jpeg(frame.jpeg, self.scale), frame.captured, frame.timestamp)
+                except Exception as e:
+                    print(f"❌ Thumbnail {self.relay.stream_id} scaling error: {e}")
+        finally:
+            self.relay.unsubscribe(source)
+
+
+class RecordingSegment:
+    """One clip on disk: the pre-event frames plus everything until the trigger expires"""
+
+    def __init__(self, stream_id, directory, reason):
+        self.stream_id = stream_id
+        self.reason = reason
+        self.started = time.time()
+        name = time.strftime('%Y%m%d-%H%M%S', time.localtime(self.started))
+        self.path = os.path.join(directory, stream_id, f'{name}.mjpeg')
+        self.labels = (('stream', stream_id),)
+        self.file = None
+
+
+class RecordingWriter:
+    """Dedicated thread that appends recorded frames to disk in batches
+
+    Relays hand frames over through a byte-bounded queue and never wait on the
+    disk. Everything queued since the last wake-up is written in one pass
+    through large buffered files and flushed once, so a burst of frames costs
+    one flush rather than one per frame. If the disk falls behind, new frames
+    are dropped and counted instead of stalling live delivery.
+    """
+
+    def __init__(self, max_bytes=RECORD_QUEUE_MAX_BYTES):
+        self.max_bytes = max_bytes
+        self._cond = threading.Condition()
+        self._pending = collections.deque()
+        self._bytes = 0
+        self._closed = False
+        self._thread = None
+
+    def start(self):
+        self._thread = threading.Thread(target=self._run, name='recording-writer', daemon=True)
+        self._thread.start()
+
+    def write(self, segment, frames):
+        """Queue frames for a segment; False if they were dropped for lack of room"""
+        size = sum(len(frame.jpeg) for frame in frames)
+        with self._cond:
+            if self._closed or self._bytes + size > self.max_bytes:
+                METRICS.inc('streamserver_recording_dropped_frames_total', segment.labels, len(frames))
+                return False
+            self._pending.append((segment, frames))
+            self._bytes += size
+            self._cond.notify()
+        return True
+
+    def finish(self, segment):
+        """Close a segment's file once everything queued before it is written"""
+        with self._cond:
+            self._pending.append((segment, None))
+            self._cond.notify()
+
+    def close(self):
+        """Write out what is queued, close every file and stop the thread"""
+        with self._cond:
+            self._closed = True
+            self._cond.notify()
+        if self._thread is not None:
+            self._thread.join(timeout=RELAY_RETRY_SECONDS)
+
+    def _run(self):
+        # Every segment with a file open, not just those in the latest batch
+        open_segments = {}
+        while True:
+            with self._cond:
+                self._cond.wait_for(lambda: self._pending or self._closed)
+                batch = list(self._pending)
+                self._pending.clear()
+                self._bytes = 0
+                closing = self._closed
+            touched = {}
+            for segment, frames in batch:
+                try:
+                    if frames is None:
+                        if segment.file is not None:
+                            segment.file.close()
+                            segment.file = None
+                        touched.pop(id(segment), None)
+                        open_segments.pop(id(segment), None)
+                        continue
+                    if segment.file is None:
+                        os.makedirs(os.path.dirname(segment.path), exist_ok=True)
+                        # Append-only: a crash leaves a truncated but playable clip
+                        segment.file = open(segment.path, 'ab', buffering=RECORD_WRITE_BUFFER)
+                        open_segments[id(segment)] = segment
+                    segment.file.writelines(frame.jpeg for frame in frames)
+                    METRICS.inc('streamserver_recording_bytes_written_total', segment.labels,
+                                sum(len(frame.jpeg) for frame in frames))
+                    touched[id(segment)] = segment
+                except OSError as e:
+                    print(f"❌ Recording {segment.path} write error: {e}")
+            for segment in touched.values():
+                try:
+                    segment.file.flush()
+                except OSError as e:
+                    print(f"❌ Recording {segment.path} write error: {e}")
+            if closing and not self._pending:
+                for segment in open_segments.values():
+                    try:
+                        # Flushes whatever an earlier batch left in the buffer
+                        segment.file.close()
+                    except OSError as e:
+                        print(f"❌ Recording {segment.path} write error: {e}")
+                    segment.file = None
+                return
+
+
+class Recorder:
+    """Keeps the last few seconds of one relay in memory and records them on a trigger
+
+    Frames are only referenced, never copied: the pre-event ring holds the same
+    Frame objects the relay fans out. A trigger hands the ring to the writer
+    and keeps recording until post_seconds after the latest trigger.
+    """
+
+    def __init__(self, stream_id, writer, settings=None, events=None):
+        settings = settings or {}
+        self.stream_id = stream_id
+        self.writer = writer
+        self.events = events
+        self.pre_seconds = settings.get('pre_seconds', RECORD_PRE_SECONDS)
+        self.post_seconds = settings.get('post_seconds', RECORD_POST_SECONDS)
+        self.directory = settings.get('directory', RECORD_DIRECTORY)
+        self._frames = collections.deque()
+        self._bytes = 0
+        self._lock = threading.Lock()
+        self._segment = None
+        self._until = 0.0
+        self._last_seq = 0
+
+    @property
+    def active(self):
+        return self._segment is not None
+
+    def add(self, frame):
+        """Called by the relay for every ingested frame"""
+        finished = None
+        with self._lock:
+            segment = self._segment
+            if segment is not None:
+                if frame.timestamp <= self._until:
+                    self.writer.write(segment, (frame,))
+                    self._last_seq = frame.seq
+                else:
+                    finished = self._end()
+            frames = self._frames
+            frames.append(frame)
+            self._bytes += len(frame.jpeg)
+            horizon = frame.timestamp - self.pre_seconds
+            while len(frames) > 1 and (frames[0].timestamp < horizon or self._bytes > RECORD_PRE_MAX_BYTES):
+                self._bytes -= len(frames.popleft().jpeg)
+        if finished is not None:
+            self._announce(finished, False)
+
+    def trigger(self, reason='api'):
+        """Start recording, or extend the running recording; returns (segment, until)"""
+        with self._lock:
+            self._until = max(self._until, time.time() + self.post_seconds)
+            segment = self._segment
+            started = segment is None
+            if started:
+                segment = self._segment = RecordingSegment(self.stream_id, self.directory, reason)
+                # Frames already in the previous clip are not recorded twice
+                pre_roll = [frame for frame in self._frames if frame.seq > self._last_seq]
+                if pre_roll:
+                    self.writer.write(segment, pre_roll)
+                    self._last_seq = pre_roll[-1].seq
+            until = self._until
+        if started:
+            self._announce(segment, True)
+        return segment, until
+
+    def stop(self):
+        with self._lock:
+            finished = self._end() if self._segment is not None else None
+            self._frames.clear()
+            self._bytes = 0
+        if finished is not None:
+            self._announce(finished, False)
+
+    def _end(self):
+        segment, self._segment = self._segment, None
+        self.writer.finish(segment)
+        return segment
+
+    def _announce(self, segment, active):
+        if active:
+            print(f"⏺️  Recording {self.stream_id} ({segment.reason}) to {segment.path}")
+        else:
+            print(f"💾 Saved recording {segment.path}")
+        if self.events is not None:
+            self.events.publish('recording', {'stream': self.stream_id, 'active': active,
+                                              'reason': segment.reason, 'file': segment.path})
+
+
+def luma_plane(jpeg):
+    """Decode a JPEG to a tiny fixed-size greyscale plane for motion scoring
+
+    draft('L') has libjpeg decode only the luma channel at 1/8 scale in the
+    DCT domain, so the full-resolution image is never reconstructed.
+    """
+    image = Image.open(io.BytesIO(jpeg))
+    image.draft('L', (image.width // 8, image.height // 8))
+    image = image.convert('L')
+    if image.size != MOTION_SIZE:
+        image = image.resize(MOTION_SIZE, Image.BILINEAR)
+    return numpy.asarray(image, dtype=numpy.int16) if numpy is not None else image
+
+
+def motion_score(previous, current, pixel_threshold):
+    """Fraction of pixels whose brightness changed by more than pixel_threshold"""
+    if numpy is not None:
+        changed = numpy.count_nonzero(numpy.abs(current - previous) > pixel_threshold)
+    else:
+        mask = ImageChops.difference(current, previous).point(lambda v: 255 if v > pixel_threshold else 0)
+        changed = mask.histogram()[255]
+    return changed / (MOTION_SIZE[0] * MOTION_SIZE[1])
+
+
+class MotionDetector:
+    """Motion state of one relay, updated from frames sampled by the MotionMonitor"""
+
+    def __init__(self, relay, settings):
+        self.relay = relay
+        self.labels = relay.labels
+        self.threshold = settings.get('threshold', MOTION_THRESHOLD)
+        self.pixel_threshold = settings.get('pixel_threshold', MOTION_PIXEL_THRESHOLD)
+        self.cooldown = settings.get('cooldown_seconds', MOTION_COOLDOWN_SECONDS)
+        self.score = 0.0
+        self.active = False
+        self.last_motion = 0.0
+        self.seq = 0
+        # Set while a frame is with the worker pool; at most one job per stream
+        self.busy = False
+        self._previous = None
+
+    def update(self, frame):
+        """Score a frame against the previous sample; True if motion just started"""
+        current = luma_plane(frame.jpeg)
+        previous, self._previous = self._previous, current
+        self.seq = frame.seq
+        if previous is None:
+            return False
+        self.score = motion_score(previous, current, self.pixel_threshold)
+        if self.score < self.threshold:
+            return False
+        self.last_motion = frame.timestamp
+        started, self.active = not self.active, True
+        return started
+
+    def expire(self, now):
+        """Clear the motion state after a quiet cooldown; True if it just ended"""
+        if self.active and now - self.last_motion > self.cooldown:
+            self.active = False
+            return True
+        return False
+
+
+class MotionMonitor:
+    """Samples every relay's newest frame at a low rate and scores it for motion
+
+    Only a few frames per second per camera are ever decoded, and a worker pool
+    separate from the HTTP threads does the decoding. A stream whose previous
+    sample is still being scored is skipped rather than queued.
+    """
+
+    def __init__(self, hub, settings):
+        self.hub = hub
+        self.interval = 1.0 / settings.get('rate', MOTION_RATE)
+        self.record = settings.get('record', True)
+        self.settings = settings
+        self.detectors = {}
+        self._pool = ThreadPoolExecutor(max_workers=settings.get('workers', MOTION_WORKERS),
+                                        thread_name_prefix='motion')
+        self._stop = threading.Event()
+
+    def start(self):
+        threading.Thread(target=self._run, name='motion-monitor', daemon=True).start()
+
+    def stop(self):
+        self._stop.set()
+        self._pool.shutdown(wait=False, cancel_futures=True)
+
+    def active(self, stream_id):
+        detector = self.detectors.get(stream_id)
+        return detector is not None and detector.active
+
+    def _run(self):
+        while not self._stop.wait(self.interval):
+            relays = self.hub.relays
+            detectors = {}
+            for stream_id, relay in relays.items():
+                detector = self.detectors.get(stream_id)
+                if detector is None or detector.relay is not relay:
+                    detector = MotionDetector(relay, self.settings)
+                detectors[stream_id] = detector
+                if detector.busy:
+                    continue
+                if detector.expire(time.time()):
+                    self._announce(detector)
+                frame = relay.ring.latest()
+                if frame is None or frame.seq == detector.seq:
+                    continue
+                detector.busy = True
+                try:
+                    self._pool.submit(self._analyse, detector, frame)
+                except RuntimeError:
+                    # The pool was shut down by stop()
+                    return
+            self.detectors = detectors
+
+    def _analyse(self, detector, frame):
+        try:
+            if detector.update(frame):
+                METRICS.inc('streamserver_motion_events_total', detector.labels)
+                self._announce(detector)
+            recorder = detector.relay.recorder
+            if detector.active and self.record and recorder is not None:
+                # Each sample with motion pushes the end of the clip further out
+                recorder.trigger('motion')
+        except Exception as e:
+            print(f"❌ Motion {detector.relay.stream_id} scoring error: {e}")
+        finally:
+            detector.busy = False
+
+    def _announce(self, detector):
+        stream_id = detector.relay.stream_id
+        if detector.active:
+            print(f"🏃 Motion on {stream_id} (score {detector.score:.3f})")
+        self.hub.events.publish('motion', {'stream': stream_id, 'active': detector.active,
+                                           'score': round(detector.score, 4)})
+
+
+def detect_encoder(ffmpeg):
+    """Pick the first TRANSCODE_ENCODERS entry this ffmpeg build supports"""
+    try:
+        listing = subprocess.run([ffmpeg, '-hide_banner', '-encoders'], capture_output=True,
+                                 text=True, timeout=RELAY_RETRY_SECONDS).stdout
+    except (OSError, subprocess.SubprocessError):
+        return None
+    names = {line.split()[1] for line in listing.splitlines() if len(line.split()) > 1}
+    return next((encoder for encoder in TRANSCODE_ENCODERS if encoder in names), None)
+
+
+def read_box(stream):
+    """Read one complete ISO BMFF box from a pipe; (type, bytes) or (None, None) at EOF"""
+    header = stream.read(8)
+    if len(header) < 8:
+        return None, None
+    size, kind = struct.unpack('>I4s', header)
+    if size == 1:
+        extended = stream.read(8)
+        if len(extended) < 8:
+            return None, None
+        header += extended
+        size = struct.unpack('>Q', extended)[0]
+    if size < len(header):
+        raise ValueError(f'unsupported box size {size} for {kind!r}')
+    body = stream.read(size - len(header))
+    if len(body) < size - len(header):
+        return None, None
+    return kind, header + body
+
+
+def iter_boxes(data, start, end):
+    """Yield (type, start, end) for each box laid out in data[start:end]"""
+    while start + 8 <= end:
+        size, kind = struct.unpack_from('>I4s', data, start)
+        if size < 8:
+            return
+        yield kind, start, start + size
+        start += size
+
+
+def fragment_samples(moof):
+    """Number of video frames in a moof box, summed from its trun boxes"""
+    count = 0
+    for kind, start, end in iter_boxes(moof, 8, len(moof)):
+        if kind == b'traf':
+            for child, child_start, _ in iter_boxes(moof, start + 8, end):
+                if child == b'trun':
+                    # Full box header (version + flags), then sample_count
+                    count += struct.unpack_from('>I', moof, child_start + 12)[0]
+    return count
+
+
+class Fragment:
+    """One moof+mdat pair: a self-contained HLS media segment"""
+
+    __slots__ = ('seq', 'data', 'duration')
+
+    def __init__(self, seq, data, duration):
+        self.seq = seq
+        self.data = data
+        self.duration = duration
+
+
+class VideoPacket:
+    """One H.264 access unit in Annex B form, as forwarded to WebRTC peers"""
+
+    __slots__ = ('data', 'timestamp', 'keyframe')
+
+    def __init__(self, data, timestamp, keyframe):
+        self.data = data
+        self.timestamp = timestamp
+        self.keyframe = keyframe
+
+
+def h264_keyframe(access_unit):
+    """Whether an Annex B access unit holds an IDR slice, so decoding can start there"""
+    start = access_unit.find(b'\x00\x00\x01')
+    while 0 <= start < len(access_unit) - 3:
+        if access_unit[start + 3] & 0x1f == 5:
+            return True
+        start = access_unit.find(b'\x00\x00\x01', start + 3)
+    return False
+
+
+class FragmentSubscriber:
+    """Bounded queue of fragments for one live.mp4 viewer
+
+    Video fragments depend on each other, so unlike MJPEG frames they can't be
+    skipped: a viewer that falls TRANSCODE_LIVE_BACKLOG fragments behind is
+    disconnected instead.
+    """
+
+    def __init__(self):
+        self._queue = queue.Queue(maxsize=TRANSCODE_LIVE_BACKLOG)
+        self.closed = False
+
+    def offer(self, fragment):
+        try:
+            self._queue.put_nowait(fragment)
+        except queue.Full:
+            self.close()
+
+    def close(self):
+        self.closed = True
+        try:
+            self._queue.put_nowait(None)
+        except queue.Full:
+            pass
+
+    def get(self, timeout=None):
+        """Next fragment; None on timeout or once closed"""
+        try:
+            return self._queue.get(timeout=timeout)
+        except queue.Empty:
+            return None
+
+
+class Transcoder:
+    """One ffmpeg process turning a relay into fragmented MP4, shared by every remote viewer
+
+    The encoder starts on the first HLS or live.mp4 request and exits after
+    TRANSCODE_IDLE_SECONDS without one. Its output is split into the init
+    segment (ftyp+moov) and moof+mdat fragments, and the newest few fragments
+    are kept in memory; nothing touches the disk.
+    """
+
+    def __init__(self, relay, settings, ffmpeg, encoder):
+        self.relay = relay
+        self.ffmpeg = ffmpeg
+        self.encoder = settings.get('encoder', 'auto')
+        if self.encoder == 'auto':
+            self.encoder = encoder
+        self.bitrate = str(settings.get('bitrate', TRANSCODE_BITRATE))
+        self.segment_seconds = settings.get('segment_seconds', TRANSCODE_SEGMENT_SECONDS)
+        self.labels = relay.labels
+        self.init = None
+        self.fragments = collections.deque(maxlen=TRANSCODE_PLAYLIST_SEGMENTS)
+        self._seq = 0
+        self._subscribers = ()
+        self._cond = threading.Condition()
+        self._process = None
+        self._last_access = 0.0
+        self._stopped = False
+
+    # Whether ffmpeg reads the relay's JPEGs on stdin rather than the camera itself
+    feeds_frames = True
+
+    @property
+    def running(self):
+        return self._process is not None
+
+    def _started(self):
+        print(f"🎞️  Transcoding {self.relay.stream_id} with {self.encoder}")
+
+    def command(self):
+        """ffmpeg arguments reading JPEGs on stdin and writing fMP4 to stdout"""
+        encode = ['-c:v', self.encoder, '-b:v', self.bitrate, '-pix_fmt', 'yuv420p']
+        if self.encoder == 'libx264':
+            encode += ['-preset', 'veryfast', '-tune', 'zerolatency']
+        return ([self.ffmpeg, '-hide_banner', '-loglevel', 'error',
+                 '-f', 'mjpeg', '-use_wallclock_as_timestamps', '1', '-i', 'pipe:0', '-an']
+                + encode
+                # A keyframe per segment so each fragment can start playback
+                + ['-force_key_frames', f'expr:gte(t,n_forced*{self.segment_seconds})',
+                   '-f', 'mp4', '-movflags', 'frag_keyframe+empty_moov+default_base_moof', 'pipe:1'])
+
+    def touch(self):
+        """Note a viewer request, starting the encoder if it isn't running"""
+        with self._cond:
+            self._last_access = time.monotonic()
+        self._spawn()
+
+    def _spawn(self):
+        with self._cond:
+            if self._process is not None or self._stopped:
+                return
+            try:
+                process = self._popen()
+            except OSError as e:
+                print(f"❌ Transcoder {self.relay.stream_id} failed to start: {e}")
+                return
+            self._process = process
+            self.init = None
+            self.fragments.clear()
+        self._started()
+        name = f'transcode-{self.relay.stream_id}'
+        if self.feeds_frames:
+            threading.Thread(target=self._feed, args=(process,), name=f'{name}-in', daemon=True).start()
+        threading.Thread(target=self._read, args=(process,), name=f'{name}-out', daemon=True).start()
+
+    def _popen(self):
+        return subprocess.Popen(self.command(), stdout=subprocess.PIPE,
+                                stdin=subprocess.PIPE if self.feeds_frames else subprocess.DEVNULL)
+
+    def stop(self):
+        with self._cond:
+            self._stopped = True
+            process = self._process
+            self._cond.notify_all()
+        if process is not None and process.poll() is None:
+            process.kill()
+        self._close_subscribers()
+
+    def wait_ready(self, timeout=TRANSCODE_START_SECONDS):
+        """Wait for the init segment and a first fragment; (init, fragments) or None if they never came
+
+        The pair is taken together, since a re-spawned encoder clears both.
+        """
+        with self._cond:
+            if not self._cond.wait_for(lambda: self.fragments or self._stopped, timeout) or not self.fragments:
+                return None
+            return self.init, list(self.fragments)
+
+    @staticmethod
+    def segment(fragments, seq):
+        for fragment in fragments:
+            if fragment.seq == seq:
+                return fragment
+        return None
+
+    @staticmethod
+    def playlist(fragments):
+        """Live HLS media playlist over a snapshot of fragments; None if there are none"""
+        if not fragments:
+            return None
+        # EXTINF values rounded to the nearest second must not exceed the target
+        target = max(1, round(max(fragment.duration for fragment in fragments)))
+        lines = ['#EXTM3U', '#EXT-X-VERSION:7', f'#EXT-X-TARGETDURATION:{target}',
+                 f'#EXT-X-MEDIA-SEQUENCE:{fragments[0].seq}', '#EXT-X-MAP:URI="init.mp4"']
+        for fragment in fragments:
+            lines.append(f'#EXTINF:{fragment.duration:.3f},')
+            lines.append(f'seg{fragment.seq}.m4s')
+        return '\n'.join(lines) + '\n'
+
+    def subscribe(self):
+        """Register a live.mp4 viewer, primed with the newest fragment"""
+        subscriber = FragmentSubscriber()
+        with self._cond:
+            if self.fragments:
+                subscriber.offer(self.fragments[-1])
+            self._subscribers = self._subscribers + (subscriber,)
+        return subscriber
+
+    def unsubscribe(self, subscriber):
+        with self._cond:
+            self._subscribers = tuple(s for s in self._subscribers if s is not subscriber)
+        subscriber.close()
+
+    def _close_subscribers(self):
+        with self._cond:
+            subscribers, self._subscribers = self._subscribers, ()
+        for subscriber in subscribers:
+            subscriber.close()
+
+    def _idle(self):
+        return not self._subscribers and time.monotonic() - self._last_access > TRANSCODE_IDLE_SECONDS
+
+    def _feed(self, process):
+        source = self.relay.subscribe()
+        try:
+            while not source.closed and process.poll() is None:
+                frame = source.get(timeout=RELAY_RETRY_SECONDS)
+                with self._cond:
+                    if self._stopped or self._idle():
+                        break
+                if frame is not None:
+                    process.stdin.write(frame.jpeg)
+                    process.stdin.flush()
+        except (BrokenPipeError, OSError):
+            pass
+        finally:
+            self.relay.unsubscribe(source)
+            try:
+                # EOF lets ffmpeg flush its last fragment and exit
+                process.stdin.close()
+            except OSError:
+                pass
+
+    def _read(self, process):
+        header = []
+        moof = None
+        last = time.monotonic()
+        try:
+            while True:
+                kind, box = read_box(process.stdout)
+                if kind is None:
+                    break
+                if kind in (b'ftyp', b'moov'):
+                    header.append(box)
+                    if kind == b'moov':
+                        self.init = b''.join(header)
+                elif kind == b'moof':
+                    moof = box
+                elif kind == b'mdat' and moof is not None and self.init is not None:
+                    # Encoding runs in real time, so arrival spacing is the fragment's duration
+                    now = time.monotonic()
+                    duration = now - last if self.fragments else self.segment_seconds
+                    last = now
+                    self._add_fragment(moof, box, duration)
+                    moof = None
+        except (OSError, ValueError) as e:
+            print(f"❌ Transcoder {self.relay.stream_id} output error: {e}")
+        finally:
+            process.stdout.close()
+            try:
+                process.wait(timeout=RELAY_RETRY_SECONDS)
+            except subprocess.TimeoutExpired:
+                process.kill()
+            with self._cond:
+                if self._process is process:
+                    self._process = None
+                self._cond.notify_all()
+            self._close_subscribers()
+            print(f"⏹️  ffmpeg for {self.relay.stream_id} exited")
+
+    def _add_fragment(self, moof, mdat, duration):
+        data = moof + mdat
+        with self._cond:
+            self._seq += 1
+            fragment = Fragment(self._seq, data, duration)
+            self.fragments.append(fragment)
+            subscribers = self._subscribers
+            self._cond.notify_all()
+        METRICS.inc('streamserver_transcode_fragments_total', self.labels)
+        METRICS.inc('streamserver_transcode_bytes_total', self.labels, len(data))
+        for subscriber in subscribers:
+            subscriber.offer(fragment)
+
+
+class Remuxer(Transcoder):
+    """ffmpeg reading an H.264 camera directly and repackaging it as fragmented MP4
+
+    The video is copied, never decoded or re-encoded. Unlike a Transcoder the
+    process runs for as long as the relay does, since it is the relay's only
+    connection to the camera; StreamRelay restarts it with backoff when it exits.
+    The same process writes an Annex B copy of the video to a second pipe,
+    split into access units for WebRTC peers.
+    """
+
+    feeds_frames = False
+
+    def __init__(self, relay, settings, ffmpeg):
+        super().__init__(relay, settings, ffmpeg, 'copy')
+        self.encoder = 'copy'
+        self._last_fragment = 0.0
+        self._packet_subscribers = ()
+        # Access units since the last keyframe, so a new peer can start decoding at once
+        self._gop = []
+        self._gop_bytes = 0
+
+    def command(self):
+        if self.relay.format == 'rtsp':
+            source = ['-rtsp_transport', 'tcp', '-i', self.relay.url]
+        else:
+            # A raw H.264 elementary stream carries no timestamps of its own
+            source = ['-f', 'h264', '-use_wallclock_as_timestamps', '1', '-i', self.relay.url]
+        return ([self.ffmpeg, '-hide_banner', '-loglevel', 'error', '-fflags', 'nobuffer']
+                + source
+                + ['-an', '-c:v', 'copy',
+                   '-f', 'mp4', '-movflags', 'frag_keyframe+empty_moov+default_base_moof', 'pipe:1'])
+
+    @staticmethod
+    def packet_output(fd):
+        """ffmpeg output arguments for the Annex B copy, one AUD-led access unit per frame"""
+        # dump_extra repeats SPS/PPS on keyframes for cameras that only send them once
+        return ['-map', '0:v', '-c:v', 'copy', '-bsf:v', 'dump_extra=freq=keyframe,h264_metadata=aud=insert',
+                '-flush_packets', '1', '-f', 'h264', f'pipe:{fd}']
+
+    def _popen(self):
+        read_fd, write_fd = os.pipe()
+        try:
+            process = subprocess.Popen(self.command() + self.packet_output(write_fd), stdout=subprocess.PIPE,
+                                       stdin=subprocess.DEVNULL, pass_fds=(write_fd,))
+        except OSError:
+            os.close(read_fd)
+            raise
+        finally:
+            os.close(write_fd)
+        threading.Thread(target=self._read_packets, args=(os.fdopen(read_fd, 'rb', buffering=0),),
+                         name=f'transcode-{self.relay.stream_id}-packets', daemon=True).start()
+        return process
+
+    def _started(self):
+        print(f"🔗 Relay {self.relay.stream_id} remuxing {self.relay.format} from {self.relay.url}")
+
+    def stop(self):
+        super().stop()
+        with self._cond:
+            subscribers, self._packet_subscribers = self._packet_subscribers, ()
+        for subscriber in subscribers:
+            subscriber.close()
+
+    def subscribe_packets(self, relay_loop):
+        """Register a WebRTC peer for access units, primed with the current keyframe interval"""
+        subscriber = PacketSubscriber(relay_loop)
+        self.relay.acquire()
+        with self._cond:
+            for packet in self._gop:
+                subscriber.offer(packet)
+            self._packet_subscribers = self._packet_subscribers + (subscriber,)
+        return subscriber
+
+    def unsubscribe_packets(self, subscriber):
+        with self._cond:
+            subscribed = subscriber in self._packet_subscribers
+            self._packet_subscribers = tuple(s for s in self._packet_subscribers if s is not subscriber)
+        subscriber.close()
+        if subscribed:
+            self.relay.release()
+
+    def _read_packets(self, pipe):
+        # ffmpeg starts every access unit with an AUD, so each one ends where the next AUD begins
+        # Past the AUD (and its leading zero byte) the buffer starts with
+        skip = len(H264_AUD) + 1
+        buffer = bytearray()
+        scanned = skip
+        try:
+            while True:
+                data = pipe.read(RELAY_CHUNK_SIZE)
+                if not data:
+                    # The last access unit is complete once ffmpeg exits
+                    if H264_AUD in buffer[:skip]:
+                        self._add_packet(bytes(buffer))
+                    break
+                buffer += data
+                while True:
+                    cut = buffer.find(H264_AUD, scanned)
+                    if cut < 0:
+                        scanned = max(len(buffer) - len(H264_AUD) + 1, skip)
+                        break
+                    if buffer[cut - 1] == 0:
+                        cut -= 1
+                    if H264_AUD in buffer[:skip]:
+                        self._add_packet(bytes(buffer[:cut]))
+                    del buffer[:cut]
+                    scanned = skip
+                if len(buffer) > RELAY_MAX_FRAME_SIZE:
+                    buffer.clear()
+                    scanned = skip
+        except OSError:
+            pass
+        finally:
+            pipe.close()
+        with self._cond:
+            # The next process starts over with fresh parameter sets
+            self._gop = []
+            self._gop_bytes = 0
+
+    def _add_packet(self, data):
+        packet = VideoPacket(data, time.time(), h264_keyframe(data))
+        with self._cond:
+            if packet.keyframe:
+                self._gop, self._gop_bytes = [packet], len(data)
+            elif self._gop and self._gop_bytes + len(data) <= WEBRTC_GOP_CACHE_BYTES:
+                self._gop.append(packet)
+                self._gop_bytes += len(data)
+            else:
+                # Too long a keyframe interval to cache; new peers wait for the next keyframe
+                self._gop, self._gop_bytes = [], 0
+            subscribers = self._packet_subscribers
+        for subscriber in subscribers:
+            subscriber.offer(packet)
+
+    def _idle(self):
+        return False
+
+    def touch(self):
+        # Viewers never start the process themselves; the relay's run() loop does
+        with self._cond:
+            self._last_access = time.monotonic()
+        self.relay.prewarm()
+
+    def subscribe(self):
+        self.relay.acquire()
+        return super().subscribe()
+
+    def unsubscribe(self, subscriber):
+        super().unsubscribe(subscriber)
+        self.relay.release()
+
+    def run(self):
+        """Run ffmpeg until it exits, stalls or is no longer wanted
+
+        Returns the reason it stopped, or None if it was stopped for being idle.
+        """
+        self._last_fragment = time.monotonic()
+        self._spawn()
+        with self._cond:
+            process = self._process
+        if process is None:
+            return 'ffmpeg failed to start'
+        while True:
+            with self._cond:
+                if self._cond.wait_for(lambda: self._process is not process, RELAY_STALL_SECONDS):
+                    break
+            if not self.relay.wanted():
+                print(f"💤 Relay {self.relay.stream_id} idle, disconnecting")
+                process.kill()
+                return None
+            # Fragments are cut at keyframes, so allow for a long keyframe interval
+            if time.monotonic() - self._last_fragment > 3 * RELAY_STALL_SECONDS:
+                process.kill()
+                return 'upstream stalled'
+        return f'ffmpeg exited with status {process.returncode}'
+
+    def _add_fragment(self, moof, mdat, duration):
+        self._last_fragment = time.monotonic()
+        frames = fragment_samples(moof)
+        METRICS.inc('streamserver_upstream_bytes_total', self.labels, len(moof) + len(mdat))
+        METRICS.inc('streamserver_upstream_frames_total', self.labels, frames)
+        self.relay.health.frame(len(moof) + len(mdat), frames)
+        super()._add_fragment(moof, mdat, duration)
+
+
+class RelayVideoTrack(VideoStreamTrack):
+    """WebRTC video track fed from a relay's latest-frame-wins slot
+
+    Frames are stamped with their arrival time rather than paced to a fixed
+    rate, so a frame goes out the moment it is decoded. Waiting for a frame
+    holds no thread - a peer of an offline camera costs nothing but its
+    subscriber - and decoding runs in the gateway's own small pool, leaving
+    the default executor to aiortc's encoders.
+    """
+
+    def __init__(self, relay, client, relay_loop, decoders):
+        super().__init__()
+        self.relay = relay
+        self._subscriber = relay.subscribe(client=client, relay_loop=relay_loop)
+        self._decoder = av.CodecContext.create('mjpeg', 'r')
+        self._decoders = decoders
+        self._start = None
+
+    async def recv(self):
+        loop = asyncio.get_running_loop()
+        while True:
+            frame = await self._subscriber.next()
+            if frame is None:
+                self.stop()
+                raise MediaStreamError
+            try:
+                decoded = await loop.run_in_executor(self._decoders, self._decoder.decode, av.Packet(frame.jpeg))
+            except Exception:
+                # A corrupt frame is skipped, not fatal to the peer
+                continue
+            if decoded:
+                break
+        timestamp, video = frame.timestamp, decoded[-1]
+        if self._start is None:
+            self._start = timestamp
+        video.pts = int((timestamp - self._start) * WEBRTC_CLOCK_RATE)
+        video.time_base = fractions.Fraction(1, WEBRTC_CLOCK_RATE)
+        return video
+
+    def stop(self):
+        super().stop()
+        self.relay.unsubscribe(self._subscriber)
+
+
+class PacketSubscriber:
+    """Queue of H.264 access units for one WebRTC peer, read on a RelayLoop
+
+    Access units depend on each other, so none is skipped on its own. A peer
+    that falls WEBRTC_PACKET_BACKLOG behind drops its backlog and resumes at
+    the next keyframe instead, which a WebRTC receiver recovers from.
+    """
+
+    def __init__(self, relay_loop):
+        self._relay_loop = relay_loop
+        self._packets = collections.deque()
+        self._keyframe_wanted = True
+        self._closed = False
+        # Created on the loop itself; Python 3.9 binds an Event to a loop at construction
+        self._ready = None
+
+    def offer(self, packet):
+        self._relay_loop.call(lambda: self._put(packet))
+
+    def close(self):
+        self._relay_loop.call(self._close)
+
+    def _put(self, packet):
+        if len(self._packets) >= WEBRTC_PACKET_BACKLOG:
+            self._packets.clear()
+            self._keyframe_wanted = True
+        if self._keyframe_wanted and not packet.keyframe:
+            return
+        self._keyframe_wanted = False
+        self._packets.append(packet)
+        self._wake()
+
+    def _close(self):
+        self._closed = True
+        self._wake()
+
+    def _wake(self):
+        if self._ready is not None:
+            self._ready.set()
+
+    async def next(self):
+        """Wait for the next access unit; None once closed"""
+        if self._ready is None:
+            self._ready = asyncio.Event()
+        while not self._packets and not self._closed:
+            self._ready.clear()
+            await self._ready.wait()
+        return self._packets.popleft() if self._packets else None
+
+
+class RelayPacketTrack(VideoStreamTrack):
+    """WebRTC video track forwarding an H.264 relay's access units without re-encoding
+
+    The access units come from the relay's own Remuxer, so a peer opens no
+    connection of its own to the camera. Units queued from before the peer
+    joined are stamped as if they arrived then, so they are sent at once and
+    the browser catches up to live instead of lagging by a keyframe interval.
+    """
+
+    def __init__(self, relay, relay_loop):
+        super().__init__()
+        self._remuxer = relay.transcoder
+        self._subscriber = self._remuxer.subscribe_packets(relay_loop)
+        self._start = time.time()
+        self._pts = -1
+
+    async def recv(self):
+        packet = await self._subscriber.next()
+        if packet is None:
+            self.stop()
+            raise MediaStreamError
+        pts = int((max(packet.timestamp, self._start) - self._start) * WEBRTC_CLOCK_RATE)
+        self._pts = max(pts, self._pts + 1)
+        video = av.Packet(packet.data)
+        video.pts = self._pts
+        video.time_base = fractions.Fraction(1, WEBRTC_CLOCK_RATE)
+        return video
+
+    def stop(self):
+        super().stop()
+        self._remuxer.unsubscribe_packets(self._subscriber)
+
+
+class WebRTCGateway:
+    """Answers WebRTC offers for relayed streams from a private asyncio loop
+
+    MJPEG relays are decoded per peer from the relay's shared frames and
+    encoded by aiortc. H.264 cameras are forwarded without re-encoding from
+    the access units their Remuxer already reads. Signalling is a single
+    request: the browser posts a complete offer and gets a complete answer back.
+    """
+
+    def __init__(self, settings):
+        self.settings = settings
+        self.peers = {}
+        self._decoders = ThreadPoolExecutor(WEBRTC_DECODE_WORKERS, thread_name_prefix='webrtc-decode')
+        # A RelayLoop, so MJPEG peers can wait on AsyncSubscribers
+        self._relay_loop = RelayLoop(name='webrtc')
+        self._relay_loop.start()
+        self._loop = self._relay_loop.loop
+
+    @staticmethod
+    def supports(relay):
+        # H.264 is forwarded from the Remuxer, which needs ffmpeg
+        return not relay.passthrough or relay.transcoder is not None
+
+    def answer(self, relay, offer, client):
+        """Negotiate a peer connection for an SDP offer and return the answer"""
+        future = asyncio.run_coroutine_threadsafe(self._answer(relay, offer, client), self._loop)
+        return future.result(WEBRTC_ANSWER_SECONDS)
+
+    def close(self):
+        future = asyncio.run_coroutine_threadsafe(self._close_all(), self._loop)
+        try:
+            future.result(RELAY_RETRY_SECONDS)
+        except Exception:
+            pass
+        self._loop.call_soon_threadsafe(self._loop.stop)
+        self._decoders.shutdown(wait=False)
+
+    def _track(self, relay, client):
+        if not relay.passthrough:
+            return RelayVideoTrack(relay, client, self._relay_loop, self._decoders)
+        return RelayPacketTrack(relay, self._relay_loop)
+
+    async def _answer(self, relay, offer, client):
+        ice_servers = [RTCIceServer(urls=url) for url in self.settings.get('ice_servers', [])]
+        pc = RTCPeerConnection(RTCConfiguration(iceServers=ice_servers))
+        track = self._track(relay, client)
+        self.peers[pc] = relay.stream_id
+        print(f"📡 WebRTC peer {client} watching {relay.stream_id}")
+
+        @pc.on('connectionstatechange')
+        async def on_state_change():
+            if pc.connectionState in ('failed', 'closed'):
+                await self._close(pc, track)
 
-class VideoStreamHandler(http.server.SimpleHTTPRequestHandler):
-    def __init__(self, *args, **kwargs):
-        # Load video stream URLs from config file
-        self.video_streams = self.load_config()
-        super().__init__(*args, **kwargs)
-    
-    def load_config(self):
-        """Load stream configuration from config.json"""
         try:
-            config_path = os.path.join(os.path.dirname(__file__), 'config.json')
-            with open(config_path, 'r') as f:
-                config = json.load(f)
-            
-            # Extract just the URLs for the streams
-            streams = {}
-            for stream_id, stream_info in config['streams'].items():
-                streams[stream_id] = stream_info['url']
-            
-            return streams
+            sender = pc.addTrack(track)
+            if relay.passthrough:
+                # Forwarded access units are H.264, so the peer can't pick another codec
+                codecs = [codec for codec in RTCRtpSender.getCapabilities('video').codecs
+                          if codec.mimeType == 'video/H264']
+                next(t for t in pc.getTransceivers() if t.sender is sender).setCodecPreferences(codecs)
+            await pc.setRemoteDescription(RTCSessionDescription(sdp=offer['sdp'], type=offer['type']))
+            # Completes only once ICE gathering is done, so the answer has every candidate
+            await pc.setLocalDescription(await pc.createAnswer())
+        except Exception:
+            await self._close(pc, track)
+            raise
+        return {'sdp': pc.localDescription.sdp, 'type': pc.localDescription.type}
+
+    async def _close(self, pc, track):
+        if self.peers.pop(pc, None) is None:
+            return
+        track.stop()
+        await pc.close()
+
+    async def _close_all(self):
+        await asyncio.gather(*(pc.close() for pc in list(self.peers)), return_exceptions=True)
+
+
+class EventSubscriber:
+    """Bounded queue of pending events for one /api/events client
+
+    A client that stops reading loses its oldest events rather than growing
+    the queue without limit.
+    """
+
+    def __init__(self):
+        self._cond = threading.Condition()
+        self._events = collections.deque(maxlen=EVENT_QUEUE_SIZE)
+        self._closed = False
+
+    def put(self, message):
+        with self._cond:
+            self._events.append(message)
+            self._cond.notify()
+
+    def close(self):
+        with self._cond:
+            self._closed = True
+            self._cond.notify()
+
+    @property
+    def closed(self):
+        return self._closed
+
+    def get(self, timeout=None):
+        """Return all pending encoded events, or an empty list on timeout"""
+        with self._cond:
+            self._cond.wait_for(lambda: self._events or self._closed, timeout)
+            messages = list(self._events)
+            self._events.clear()
+            return messages
+
+
+class EventBus:
+    """Broadcasts server-sent events to every connected /api/events client"""
+
+    def __init__(self):
+        self._subscribers = ()
+        self._lock = threading.Lock()
+        self.tap = None
+
+    @property
+    def has_subscribers(self):
+        return bool(self._subscribers)
+
+    @staticmethod
+    def encode(event, data):
+        return f'event: {event}\ndata: {json.dumps(data)}\n\n'.encode()
+
+    def publish(self, event, data):
+        if self.tap is not None:
+            # The ingest process forwards every event to its workers' browsers
+            self.tap(event, data)
+        if not self._subscribers:
+            return
+        # Encode once, not once per client
+        message = self.encode(event, data)
+        for subscriber in self._subscribers:
+            subscriber.put(message)
+
+    def subscribe(self):
+        subscriber = EventSubscriber()
+        with self._lock:
+            self._subscribers = self._subscribers + (subscriber,)
+        return subscriber
+
+    def unsubscribe(self, subscriber):
+        with self._lock:
+            self._subscribers = tuple(s for s in self._subscribers if s is not subscriber)
+        subscriber.close()
+
+    def close(self, retry_ms=None):
+        """Disconnect every client, first asking them to reconnect after retry_ms"""
+        with self._lock:
+            subscribers, self._subscribers = self._subscribers, ()
+        for subscriber in subscribers:
+            if retry_ms is not None:
+                subscriber.put(f'retry: {retry_ms}\n\n'.encode())
+            subscriber.close()
+
+
+class RelayHub:
+    """Owns one StreamRelay per configured stream"""
+
+    def __init__(self, config):
+        self.events = EventBus()
+        self.loop = RelayLoop()
+        self.memory = MemoryBudget(self._memory_limit(config.relay))
+        self.writer = RecordingWriter()
+        self.recording_settings = config.recording
+        self.motion_settings = config.motion
+        self.motion = self._create_motion_monitor()
+        self.transcode_settings = config.transcode
+        self.ffmpeg, self.encoder = self._find_ffmpeg()
+        self.webrtc = self._create_webrtc(config.webrtc)
+        self.relays = {stream_id: self._create_relay(stream_id, url, config)
+                       for stream_id, url in config.video_streams.items()}
+        for relay in self.relays.values():
+            self._attach_recorder(relay)
+            self._attach_transcoder(relay)
+        self._lock = threading.Lock()
+        self._stop = threading.Event()
+
+    def start(self):
+        self.loop.start()
+        self.writer.start()
+        for relay in self.relays.values():
+            relay.start()
+        if self.motion is not None:
+            self.motion.start()
+        threading.Thread(target=self._publish_stats, name='relay-stats', daemon=True).start()
+
+    def drain(self, retry_ms=None):
+        """Disconnect every viewer once its current frame is out; pages reconnect after retry_ms"""
+        with self._lock:
+            if self._stop.is_set():
+                return
+            self._stop.set()
+            if self.motion is not None:
+                self.motion.stop()
+            for relay in self.relays.values():
+                relay.stop()
+        if self.webrtc is not None:
+            self.webrtc.close()
+        self.events.close(retry_ms)
+
+    def stop(self):
+        self.drain()
+        self.writer.close()
+        self.loop.stop()
+
+    @staticmethod
+    def _memory_limit(settings):
+        return int(settings.get('memory_limit_mb', RELAY_MEMORY_LIMIT_MB) * 1024 * 1024)
+
+    def _create_motion_monitor(self):
+        if not self.motion_settings.get('enabled'):
+            return None
+        if Image is None:
+            print("⚠️  Motion detection needs Pillow (pip install Pillow); disabled")
+            return None
+        return MotionMonitor(self, self.motion_settings)
+
+    @staticmethod
+    def _create_webrtc(settings):
+        if not settings.get('enabled', True):
+            return None
+        if RTCPeerConnection is None:
+            if settings.get('enabled'):
+                print("⚠️  WebRTC needs aiortc (pip install aiortc); disabled")
+            return None
+        return WebRTCGateway(settings)
+
+    def _create_relay(self, stream_id, url, config):
+        return StreamRelay(stream_id, url, config.relay, self.events,
+                           config.stream_formats.get(stream_id, 'mjpeg'), self.loop, self.memory)
+
+    def _find_ffmpeg(self):
+        """ffmpeg binary and H.264 encoder; the encoder is only looked up if transcoding is on"""
+        ffmpeg = shutil.which(self.transcode_settings.get('ffmpeg', 'ffmpeg'))
+        if not self.transcode_settings.get('enabled'):
+            return ffmpeg, None
+        if ffmpeg is None:
+            print("⚠️  Transcoding needs ffmpeg (sudo apt install ffmpeg); HLS output disabled")
+            return None, None
+        encoder = detect_encoder(ffmpeg)
+        if encoder is None:
+            print("⚠️  ffmpeg has no H.264 encoder; HLS output disabled")
+        return ffmpeg, encoder
+
+    def _attach_transcoder(self, relay):
+        if relay.transcoder is not None:
+            relay.transcoder.stop()
+        if relay.passthrough:
+            if self.ffmpeg is None:
+                print(f"⚠️  {relay.stream_id} is {relay.format} and needs ffmpeg (sudo apt install ffmpeg)")
+            relay.transcoder = Remuxer(relay, self.transcode_settings, self.ffmpeg) if self.ffmpeg else None
+        else:
+            relay.transcoder = (Transcoder(relay, self.transcode_settings, self.ffmpeg, self.encoder)
+                                if self.encoder else None)
+
+    def _attach_recorder(self, relay):
+        if relay.recorder is not None:
+            relay.recorder.stop()
+        relay.recorder = (Recorder(relay.stream_id, self.writer, self.recording_settings, self.events)
+                          if self.recording_settings.get('enabled') else None)
+        self._update_always_on(relay)
+
+    def _update_always_on(self, relay):
+        # The pre-event buffer and motion scoring need frames whether or not anyone watches
+        relay.set_always_on(not relay.passthrough and (relay.recorder is not None or self.motion is not None))
+
+    def prewarm(self):
+        """Connect every idle relay ahead of viewers that are about to subscribe"""
+        for relay in self.relays.values():
+            relay.prewarm()
+
+    def collect_metrics(self):
+        """Gauges sampled at scrape time for /metrics"""
+        samples = [('streamserver_memory_limit_bytes', (), self.memory.limit),
+                   ('streamserver_memory_used_bytes', (), self.memory.used)]
+        for relay in self.relays.values():
+            labels = relay.labels
+            samples.append(('streamserver_upstream_up', labels, int(relay.health.status == 'online')))
+            samples.append(('streamserver_upstream_fps', labels, round(relay.health.fps, 2)))
+            samples.append(('streamserver_recording_active', labels, int(relay.recording)))
+            if relay.transcoder is not None:
+                samples.append(('streamserver_transcode_running', labels, int(relay.transcoder.running)))
+            detector = self.motion.detectors.get(relay.stream_id) if self.motion is not None else None
+            if detector is not None:
+                samples.append(('streamserver_motion_score', labels, round(detector.score, 4)))
+                samples.append(('streamserver_motion_active', labels, int(detector.active)))
+            if self.webrtc is not None:
+                peers = sum(1 for stream_id in list(self.webrtc.peers.values()) if stream_id == relay.stream_id)
+                samples.append(('streamserver_webrtc_peers', labels, peers))
+            samples.extend(self._viewer_metrics(relay))
+        return samples
+
+    @staticmethod
+    def _viewer_metrics(relay):
+        sources = [relay]
+        if relay._thumbnail is not None:
+            sources.append(relay._thumbnail)
+        for source in sources:
+            subscribers = source.subscribers()
+            yield 'streamserver_relay_subscribers', source.tier_labels, len(subscribers)
+            yield 'streamserver_relay_buffer_bytes', source.tier_labels, source.ring.bytes
+            for subscriber in subscribers:
+                # Connected viewers' drops join the total of those already gone
+                dropped = subscriber.dropped
+                yield 'streamserver_relay_dropped_frames_total', source.tier_labels, dropped
+                yield ('streamserver_relay_client_dropped_frames',
+                       source.tier_labels + (('client', subscriber.client),), dropped)
+
+    def stream_status(self, relay):
+        """Health snapshot of one relay plus its recording and motion state"""
+        motion = self.motion is not None and self.motion.active(relay.stream_id)
+        return {**relay.health.snapshot(), 'recording': relay.recording, 'motion': motion}
+
+    def status(self):
+        """Status of every relay, keyed by stream id"""
+        return {stream_id: self.stream_status(relay) for stream_id, relay in self.relays.items()}
+
+    def _publish_stats(self):
+        while not self._stop.wait(EVENT_STATS_INTERVAL):
+            if not self.events.has_subscribers:
+                continue
+            stats = {}
+            for stream_id, relay in self.relays.items():
+                fps, kbps = relay.health.rates()
+                stats[stream_id] = {'fps': round(fps, 1), 'kbps': round(kbps),
+                                    'viewers': relay.subscriber_count}
+            self.events.publish('stats', stats)
+
+    def get(self, stream_id):
+        return self.relays.get(stream_id)
+
+    def reconfigure(self, config):
+        """Start, stop or re-point relays to match a reloaded config"""
+        video_streams, settings = config.video_streams, config.relay
+        with self._lock:
+            if self._stop.is_set():
+                return
+            self.memory.limit = self._memory_limit(settings)
+            relays = dict(self.relays)
+            for stream_id, relay in list(relays.items()):
+                if (video_streams.get(stream_id) != relay.url or relay.settings != settings
+                        or config.stream_formats.get(stream_id, 'mjpeg') != relay.format):
+                    relay.stop()
+                    del relays[stream_id]
+            recording_changed = config.recording != self.recording_settings
+            self.recording_settings = config.recording
+            transcode_changed = config.transcode != self.transcode_settings
+            if transcode_changed:
+                self.transcode_settings = config.transcode
+                self.ffmpeg, self.encoder = self._find_ffmpeg()
+            for relay in relays.values():
+                if recording_changed:
+                    self._attach_recorder(relay)
+                if transcode_changed:
+                    self._attach_transcoder(relay)
+            for stream_id, url in video_streams.items():
+                if stream_id not in relays:
+                    relays[stream_id] = self._create_relay(stream_id, url, config)
+                    self._attach_recorder(relays[stream_id])
+                    self._attach_transcoder(relays[stream_id])
+                    relays[stream_id].start()
+            self.relays = relays
+            if self.webrtc is not None:
+                # Applies to peers that connect from now on
+                self.webrtc.settings = config.webrtc
+            if config.motion != self.motion_settings:
+                if self.motion is not None:
+                    self.motion.stop()
+                self.motion_settings = config.motion
+                self.motion = self._create_motion_monitor()
+                if self.motion is not None:
+                    self.motion.start()
+                for relay in relays.values():
+                    self._update_always_on(relay)
+        self.events.publish('config', {'streams': list(video_streams)})
+
+
+class IngestRelayHub(RelayHub):
+    """RelayHub of the ingest process in multi-process mode
+
+    Every MJPEG relay also writes its frames into a SharedFrameRing that the
+    worker processes read, and every event is forwarded to the workers. HLS,
+    H.264 passthrough and WebRTC hold per-process state, so they need
+    processes: 1.
+    """
+
+    def __init__(self, config, pool):
+        self.pool = pool
+        super().__init__(config)
+        self.events.tap = pool.broadcast_event
+
+    @staticmethod
+    def _create_webrtc(settings):
+        if settings.get('enabled'):
+            print("⚠️  WebRTC needs processes: 1; disabled")
+        return None
+
+    def _find_ffmpeg(self):
+        if self.transcode_settings.get('enabled'):
+            print("⚠️  HLS transcoding needs processes: 1; disabled")
+        return None, None
+
+    def _create_relay(self, stream_id, url, config):
+        relay = super()._create_relay(stream_id, url, config)
+        if not relay.passthrough:
+            relay.mirror = SharedFrameRing.create(relay.ring.max_bytes // SHARED_RING_SLOTS, self.pool.wake)
+        return relay
+
+    def _attach_transcoder(self, relay):
+        relay.transcoder = None
+        if relay.passthrough:
+            print(f"⚠️  {relay.stream_id} is {relay.format}, which needs processes: 1")
+
+    def rings(self):
+        """Shared memory block name of each stream's ring, for the workers"""
+        return {stream_id: relay.mirror.name for stream_id, relay in self.relays.items()
+                if relay.mirror is not None}
+
+
+class SharedRelay(StreamRelay):
+    """A worker's view of a relay whose upstream is read by the ingest process
+
+    Frames are copied out of the ingest process's SharedFrameRing whenever it
+    signals the wake pipe; demand is forwarded there so lazy upstreams still
+    connect only while someone watches.
+    """
+
+    def __init__(self, stream_id, url, settings, stream_format, relay_loop, memory, client):
+        super().__init__(stream_id, url, settings, None, stream_format, relay_loop, memory)
+        self.client = client
+        self.shared = None
+        self._seq = 0
+
+    def start(self):
+        # Nothing to connect to; frames arrive once attach() names a ring
+        pass
+
+    def stop(self):
+        super().stop()
+        self.relay_loop.call(lambda: self.attach(None))
+
+    def attach(self, name):
+        """Read from the ring of that name from now on; runs on the relay loop"""
+        if self.shared is not None:
+            if self.shared.name == name:
+                return
+            self.shared.close()
+        self.shared = None
+        self._seq = 0
+        if name is None or self._stop.is_set():
+            return
+        try:
+            self.shared = SharedFrameRing.attach(name)
         except FileNotFoundError:
-            print("⚠️  config.json not found, using default URLs")
-            return {
-                'stream1': 'http://192.168.1.100:8080/stream',
-                'stream2': 'http://192.168.1.101:8080/stream', 
-                'stream3': 'http://192.168.1.102:8080/stream'
-            }
-        except Exception as e:
-            print(f"❌ Error loading config: {e}")
-            return {}
-    
-    def do_GET(self):
-        parsed_path = urlparse(self.path)
+            # Replaced again already; the next config names its successor
+            return
+        self.poll()
+
+    def poll(self):
+        """Publish the ring's newest frame, if it hasn't been yet; runs on the relay loop"""
+        if self.shared is None:
+            return
+        part = self.shared.read(self._seq)
+        if part is None:
+            return
+        self._seq, jpeg, timestamp, captured = part
+        self.health.frame(len(jpeg))
+        self._publish(jpeg, captured, timestamp)
+
+    def acquire(self):
+        super().acquire()
+        self.client.send(('acquire', self.stream_id))
+
+    def release(self):
+        super().release()
+        self.client.send(('release', self.stream_id))
+
+    def prewarm(self):
+        self.client.send(('prewarm', self.stream_id))
+
+
+RemoteSegment = collections.namedtuple('RemoteSegment', 'path')
+
+
+class RemoteRecorder:
+    """A worker's stand-in for the Recorder that runs in the ingest process"""
+
+    def __init__(self, client, stream_id):
+        self.client = client
+        self.stream_id = stream_id
+        self.active = False
+
+    def trigger(self, reason='api'):
+        reply = self.client.call('record', self.stream_id, reason)
+        if reply is None:
+            raise LookupError(f"the ingest process is not recording {self.stream_id}")
+        path, until = reply
+        return RemoteSegment(path), until
+
+    def stop(self):
+        pass
+
+
+class WorkerRelayHub(RelayHub):
+    """RelayHub of a worker process, fed from the ingest process's shared memory
+
+    Upstreams, recording and motion detection all run in the ingest process;
+    this hub mirrors their state from the events it forwards and republishes
+    them to its own browsers.
+    """
+
+    def __init__(self, config, client, wake):
+        self.client = client
+        self.wake = wake
+        self.rings = {}
+        self.motion_states = {}
+        super().__init__(config)
+
+    def start(self):
+        super().start()
+        self.loop.call(self._watch_wake)
+
+    def _watch_wake(self):
+        os.set_blocking(self.wake.fileno(), False)
+        self.loop.loop.add_reader(self.wake.fileno(), self._frames_ready)
+
+    def _frames_ready(self):
+        try:
+            if not os.read(self.wake.fileno(), 4096):
+                # The ingest process is gone
+                self.loop.loop.remove_reader(self.wake.fileno())
+                return
+        except BlockingIOError:
+            pass
+        for relay in self.relays.values():
+            relay.poll()
+
+    def _create_motion_monitor(self):
+        return None
+
+    def _find_ffmpeg(self):
+        return None, None
+
+    @staticmethod
+    def _create_webrtc(settings):
+        return None
+
+    def _create_relay(self, stream_id, url, config):
+        return SharedRelay(stream_id, url, config.relay, config.stream_formats.get(stream_id, 'mjpeg'),
+                           self.loop, self.memory, self.client)
+
+    def _attach_transcoder(self, relay):
+        relay.transcoder = None
+
+    def _attach_recorder(self, relay):
+        relay.recorder = (RemoteRecorder(self.client, relay.stream_id)
+                          if self.recording_settings.get('enabled') else None)
+
+    def reconfigure(self, config):
+        super().reconfigure(config)
+        for stream_id, relay in self.relays.items():
+            self.loop.call(functools.partial(relay.attach, self.rings.get(stream_id)))
+
+    def mirror(self, status):
+        """Adopt the ingest process's status() of every stream"""
+        for stream_id, state in status.items():
+            self._mirror_event('status', {'stream': stream_id, **state})
+            self._mirror_event('recording', {'stream': stream_id, 'active': state['recording']})
+            self._mirror_event('motion', {'stream': stream_id, 'active': state['motion']})
+
+    def forward(self, event, data):
+        """Republish an event of the ingest process to this worker's browsers"""
+        # This worker announces its own config changes and counts its own stats
+        if event in ('config', 'stats'):
+            return
+        self._mirror_event(event, data)
+        self.events.publish(event, data)
+
+    def _mirror_event(self, event, data):
+        relay = self.relays.get(data.get('stream'))
+        if relay is None:
+            return
+        if event == 'status':
+            relay.health.mirror(data)
+        elif event == 'recording' and relay.recorder is not None:
+            relay.recorder.active = data['active']
+        elif event == 'motion':
+            self.motion_states[relay.stream_id] = data['active']
+
+    def stream_status(self, relay):
+        status = super().stream_status(relay)
+        status['motion'] = self.motion_states.get(relay.stream_id, False)
+        return status
+
+    def collect_metrics(self):
+        # Upstream gauges come from the ingest process itself
+        return [sample for relay in self.relays.values() for sample in self._viewer_metrics(relay)]
+
+
+STREAM_BOX_TEMPLATE = """        <div class="stream-box">
+            <div class="stream-title">📹 {name}</div>
+            <div class="video-container" data-stream="{id}" onclick="toggleEnlarge(this.dataset.stream)">
+                <img id="{id}" class="video-stream" src="" alt="{name}">
+                <video id="video-{id}" class="video-stream" muted autoplay playsinline style="display: none;"></video>
+                <div id="status-{id}" class="stream-status status-offline">Offline</div>
+                <div id="stats-{id}" class="stream-stats"></div>
+                <div id="rec-{id}" class="stream-rec" style="display: none;">● REC</div>
+            </div>
+            <div class="controls">
+                <button class="btn" data-stream="{id}" onclick="toggleStream(this.dataset.stream)">Toggle Stream</button>
+                <button class="btn" data-stream="{id}" onclick="refreshStream(this.dataset.stream)">Refresh</button>
+                <button class="btn" data-stream="{id}" onclick="recordStream(this.dataset.stream)">Record</button>
+            </div>
+            <div id="error-{id}" class="error-message" style="display: none;"></div>
+        </div>
         
-        if parsed_path.path == '/':
-            self.serve_main_page()
-        elif parsed_path.path == '/api/streams':
-            self.serve_stream_config()
-        else:
-            super().do_GET()
-    
-    def serve_main_page(self):
-        """Serve the main HTML page with video streams"""
-        html_content = """<!DOCTYPE html>
-<html lang="en">
-<head>
-    <meta charset="UTF-8">
-    <meta name="viewport" content="width=device-width, initial-scale=1.0">
-    <title>Raspberry Pi Video Streams</title>
-    <style>
-        body {
-            font-family: Arial, sans-serif;
-            margin: 0;
-            padding: 20px;
-            background-color: #2c3e50;
+"""
+
+
+# Served as a minified, fingerprinted asset; see build_page_assets
+PAGE_CSS = """body {
+    font-family: Arial, sans-serif;
+    margin: 0;
+    padding: 20px;
+    background-color: #2c3e50;
+}
+
+.header {
+    text-align: center;
+    margin-bottom: 30px;
+}
+
+.header h1 {
+    color: #000000;
+    margin-bottom: 10px;
+}
+
+.streams-container {
+    display: grid;
+    grid-template-columns: repeat(auto-fit, minmax(400px, 1fr));
+    gap: 20px;
+    max-width: 1400px;
+    margin: 0 auto;
+}
+
+.stream-box {
+    background: #34495e;
+    border-radius: 8px;
+    padding: 15px;
+    box-shadow: 0 2px 10px rgba(0,0,0,0.1);
+    transition: transform 0.2s;
+}
+
+.stream-box:hover {
+    transform: translateY(-2px);
+    box-shadow: 0 4px 20px rgba(0,0,0,0.15);
+}
+
+.stream-title {
+    font-size: 18px;
+    font-weight: bold;
+    margin-bottom: 10px;
+    color: #ecf0f1;
+    text-align: center;
+}
+
+.video-container {
+    position: relative;
+    width: 100%;
+    height: 300px;
+    background: #000;
+    border-radius: 4px;
+    overflow: hidden;
+}
+
+.video-stream {
+    width: 100%;
+    height: 100%;
+    object-fit: cover;
+}
+
+.stream-box.motion {
+    box-shadow: 0 0 0 3px #f39c12, 0 4px 20px rgba(243,156,18,0.4);
+}
+
+.stream-box.enlarged {
+    position: fixed;
+    top: 20px;
+    right: 20px;
+    bottom: 20px;
+    left: 20px;
+    z-index: 900;
+    transform: none;
+}
+
+.stream-box.enlarged .video-container {
+    height: calc(100% - 90px);
+}
+
+.stream-box.enlarged .video-stream {
+    object-fit: contain;
+}
+
+.stream-status {
+    position: absolute;
+    top: 10px;
+    right: 10px;
+    background: rgba(0,0,0,0.7);
+    color: white;
+    padding: 5px 10px;
+    border-radius: 15px;
+    font-size: 12px;
+}
+
+.stream-stats {
+    position: absolute;
+    bottom: 10px;
+    left: 10px;
+    color: #ecf0f1;
+    font-size: 11px;
+    text-shadow: 0 0 3px #000;
+}
+
+.stream-rec {
+    position: absolute;
+    top: 10px;
+    left: 10px;
+    background: rgba(200,0,0,0.8);
+    color: white;
+    padding: 5px 10px;
+    border-radius: 15px;
+    font-size: 12px;
+}
+
+.status-online {
+    background: rgba(0,200,0,0.8);
+}
+
+.status-offline {
+    background: rgba(200,0,0,0.8);
+}
+
+.controls {
+    margin-top: 10px;
+    text-align: center;
+}
+
+.btn {
+    background: #007bff;
+    color: white;
+    border: none;
+    padding: 8px 16px;
+    border-radius: 4px;
+    cursor: pointer;
+    margin: 0 5px;
+    font-size: 14px;
+}
+
+.btn:hover {
+    background: #0056b3;
+}
+
+.error-message {
+    color: #dc3545;
+    text-align: center;
+    padding: 20px;
+    background: rgba(220,53,69,0.1);
+    border-radius: 4px;
+    margin-top: 10px;
+}
+
+@media (max-width: 768px) {
+    .streams-container {
+        grid-template-columns: 1fr;
+    }
+
+    .video-container {
+        height: 250px;
+    }
+}
+"""
+
+
+PAGE_JS = """let streams = {};
+const STATUS_POLL_MS = 5000;
+// How often each playing MJPEG tile's latency is sampled, and how many frames per sample
+const LATENCY_PROBE_MS = 30000;
+const LATENCY_PROBE_FRAMES = 5;
+// Browsers open at most 6 HTTP/1.1 connections per host. Besides /api/events and a latency
+// probe, relay.live_streams tiles hold an endless MJPEG stream (0: all of them); the rest
+// poll snapshots over the others
+const LIVE_STREAMS = Number(document.querySelector('.streams-container').dataset.liveStreams) || Infinity;
+const SNAPSHOT_POLL_MS = 1000;
+const liveStreams = new Set();
+const snapshotTimers = {};
+let eventSource = null;
+// One entry per stream box the server rendered into the page
+let streamStates = Object.fromEntries(
+    Array.from(document.querySelectorAll('.video-container'), el => [el.dataset.stream, false]));
+// Streams switched off with Toggle are never restarted automatically
+const stoppedStreams = new Set();
+// Tiles scrolled out of view; their streams are paused rather than stopped
+const hiddenStreams = new Set();
+// Open WebRTC connections, and streams whose WebRTC attempt failed
+const peers = {};
+const webrtcFailed = new Set();
+
+// Load stream configuration and server-side health
+async function loadStreamConfig() {
+    try {
+        const response = await fetch('/api/streams');
+        streams = await response.json();
+    } catch (error) {
+        console.error('Failed to load stream configuration:', error);
+    }
+}
+
+// Reflect the server's view of each upstream camera
+function applyStatus() {
+    Object.keys(streamStates).forEach(streamId => {
+        const info = streams[streamId];
+        if (!info) {
+            return;
         }
-        
-        .header {
-            text-align: center;
-            margin-bottom: 30px;
+        showRecording(streamId, info.recording);
+        showMotion(streamId, info.motion);
+        // An idle relay connects to the camera as soon as it gets a viewer
+        if (info.status === 'online' || info.status === 'idle') {
+            if (info.status === 'online') {
+                setStatus(streamId, true);
+            }
+            hideError(streamId);
+            // The relay connection is only (re)opened once the camera is known to be up
+            if (!streamStates[streamId] && !stoppedStreams.has(streamId) && !hiddenStreams.has(streamId)) {
+                startStream(streamId);
+            }
+        } else {
+            setStatus(streamId, false);
+            let message = info.status === 'connecting'
+                ? 'Connecting to Raspberry Pi...'
+                : 'Raspberry Pi is offline.';
+            if (info.retry_in != null) {
+                message += ` Server retrying in ${Math.ceil(info.retry_in)}s.`;
+            }
+            showError(streamId, message);
         }
-        
-        .header h1 {
-            color: #000000;
-            margin-bottom: 10px;
+    });
+}
+
+// Poll the server for stream health (one cheap request, never the Pi)
+async function pollStatus() {
+    await loadStreamConfig();
+    applyStatus();
+}
+
+function setStatus(streamId, online) {
+    const statusElement = document.getElementById(`status-${streamId}`);
+    statusElement.textContent = online ? 'Online' : 'Offline';
+    statusElement.className = online ? 'stream-status status-online' : 'stream-status status-offline';
+}
+
+// Start a video stream
+function startStream(streamId) {
+    const imgElement = document.getElementById(streamId);
+
+    if (!streams[streamId]) {
+        showError(streamId, 'Stream URL not configured');
+        return;
+    }
+    stoppedStreams.delete(streamId);
+
+    // Enlarged (interactive) viewing goes over WebRTC when the server offers it
+    const enlarged = imgElement.closest('.stream-box').classList.contains('enlarged');
+    if (enlarged && streams[streamId].webrtc && window.RTCPeerConnection && !webrtcFailed.has(streamId)) {
+        stopMJPEG(streamId);
+        startWebRTC(streamId);
+        return;
+    }
+    closePeer(streamId);
+    if (streams[streamId].transport === 'video') {
+        stopMJPEG(streamId);
+        startVideo(streamId);
+        return;
+    }
+    showMedia(streamId, false);
+
+    imgElement.onload = function() {
+        setStatus(streamId, true);
+        hideError(streamId);
+    };
+
+    imgElement.onerror = function() {
+        // No blind retry: applyStatus restarts the stream once the server reports it online
+        setStatus(streamId, false);
+        showError(streamId, 'Lost connection to the stream relay.');
+        streamStates[streamId] = false;
+        stopSnapshots(streamId);
+        releaseLive(streamId);
+    };
+
+    streamStates[streamId] = true;
+    if (!liveStreams.has(streamId) && liveStreams.size >= LIVE_STREAMS && enlarged) {
+        // The enlarged tile goes first: a grid tile falls back to snapshots
+        const demoted = Array.from(liveStreams).find(id => !isEnlarged(id));
+        if (demoted) {
+            const demotedElement = document.getElementById(demoted);
+            demotedElement.onerror = null;
+            demotedElement.src = '';
+            liveStreams.delete(demoted);
+            pollSnapshots(demoted);
         }
-        
-        .streams-container {
-            display: grid;
-            grid-template-columns: repeat(auto-fit, minmax(400px, 1fr));
-            gap: 20px;
-            max-width: 1400px;
-            margin: 0 auto;
+    }
+    if (!liveStreams.has(streamId) && liveStreams.size >= LIVE_STREAMS) {
+        pollSnapshots(streamId);
+        return;
+    }
+    stopSnapshots(streamId);
+    liveStreams.add(streamId);
+
+    // Grid tiles get the server's downscaled tier; full resolution only when enlarged.
+    // The URL is stable: reconnecting reattaches to the relay's shared upstream session
+    const streamUrl = enlarged ? streams[streamId].url : streams[streamId].thumb;
+    // Re-assigning an unchanged src may not reopen the stream, so clear it first
+    imgElement.removeAttribute('src');
+    imgElement.src = streamUrl;
+}
+
+function isEnlarged(streamId) {
+    return document.getElementById(streamId).closest('.stream-box').classList.contains('enlarged');
+}
+
+// Show a tile that has no live stream as the relay's newest frame, refreshed every SNAPSHOT_POLL_MS
+function pollSnapshots(streamId) {
+    stopSnapshots(streamId);
+    const imgElement = document.getElementById(streamId);
+    const timer = {};
+    let etag = null;
+    const poll = async () => {
+        try {
+            // no-cache revalidates with the ETag, so an unchanged frame costs a 304
+            const response = await fetch(streams[streamId].snapshot, { cache: 'no-cache' });
+            if (response.ok && response.headers.get('ETag') !== etag) {
+                etag = response.headers.get('ETag');
+                const url = URL.createObjectURL(await response.blob());
+                if (snapshotTimers[streamId] !== timer) {
+                    URL.revokeObjectURL(url);
+                    return;
+                }
+                if (timer.url) {
+                    URL.revokeObjectURL(timer.url);
+                }
+                timer.url = url;
+                imgElement.src = url;
+            }
+        } catch (error) {
+            // Offline or unreachable; applyStatus reports why
         }
-        
-        .stream-box {
-            background: #34495e;
-            border-radius: 8px;
-            padding: 15px;
-            box-shadow: 0 2px 10px rgba(0,0,0,0.1);
-            transition: transform 0.2s;
+        if (snapshotTimers[streamId] === timer) {
+            timer.id = setTimeout(poll, SNAPSHOT_POLL_MS);
         }
-        
-        .stream-box:hover {
-            transform: translateY(-2px);
-            box-shadow: 0 4px 20px rgba(0,0,0,0.15);
+    };
+    snapshotTimers[streamId] = timer;
+    poll();
+}
+
+function stopSnapshots(streamId) {
+    const timer = snapshotTimers[streamId];
+    if (timer) {
+        delete snapshotTimers[streamId];
+        clearTimeout(timer.id);
+        if (timer.url) {
+            URL.revokeObjectURL(timer.url);
         }
-        
-        .stream-title {
-            font-size: 18px;
-            font-weight: bold;
-            margin-bottom: 10px;
-            color: #ecf0f1;
-            text-align: center;
+    }
+}
+
+// Hand a freed live stream to the first tile that is polling snapshots
+function releaseLive(streamId) {
+    if (!liveStreams.delete(streamId)) {
+        return;
+    }
+    const waiting = Object.keys(snapshotTimers).find(id => id !== streamId);
+    if (waiting) {
+        startStream(waiting);
+    }
+}
+
+// Close a tile's MJPEG stream or snapshot polling
+function stopMJPEG(streamId) {
+    const imgElement = document.getElementById(streamId);
+    imgElement.onerror = null;
+    imgElement.src = '';
+    stopSnapshots(streamId);
+    releaseLive(streamId);
+}
+
+// Show the <video> element in place of the MJPEG <img>, or the other way round
+function showMedia(streamId, video) {
+    document.getElementById(streamId).style.display = video ? 'none' : 'block';
+    document.getElementById(`video-${streamId}`).style.display = video ? 'block' : 'none';
+}
+
+// Play the server's H.264 encode instead of MJPEG
+function startVideo(streamId) {
+    const videoElement = document.getElementById(`video-${streamId}`);
+    const video = streams[streamId].video;
+
+    showMedia(streamId, true);
+    videoElement.onplaying = function() {
+        setStatus(streamId, true);
+        hideError(streamId);
+    };
+    videoElement.onerror = function() {
+        setStatus(streamId, false);
+        showError(streamId, 'Lost connection to the video stream.');
+        streamStates[streamId] = false;
+    };
+
+    streamStates[streamId] = true;
+    // Safari plays HLS natively; other browsers stream the fragmented MP4 progressively
+    videoElement.src = videoElement.canPlayType('application/vnd.apple.mpegurl') ? video.hls : video.live;
+}
+
+// Near-real-time view over WebRTC; falls back to the HTTP stream if it can't connect
+async function startWebRTC(streamId) {
+    const videoElement = document.getElementById(`video-${streamId}`);
+    closePeer(streamId);
+    const pc = new RTCPeerConnection();
+    peers[streamId] = pc;
+    streamStates[streamId] = true;
+
+    pc.addTransceiver('video', { direction: 'recvonly' });
+    pc.ontrack = event => {
+        videoElement.srcObject = new MediaStream([event.track]);
+    };
+    pc.onconnectionstatechange = () => {
+        if (pc.connectionState === 'failed' && peers[streamId] === pc) {
+            fallBackFromWebRTC(streamId);
         }
-        
-        .video-container {
-            position: relative;
-            width: 100%;
-            height: 300px;
-            background: #000;
-            border-radius: 4px;
-            overflow: hidden;
+    };
+    videoElement.onplaying = function() {
+        setStatus(streamId, true);
+        hideError(streamId);
+    };
+    videoElement.onerror = null;
+    showMedia(streamId, true);
+
+    try {
+        await pc.setLocalDescription(await pc.createOffer());
+        // The server takes one complete offer rather than trickled candidates
+        await iceGatheringComplete(pc);
+        const response = await fetch(streams[streamId].webrtc, {
+            method: 'POST',
+            headers: { 'Content-Type': 'application/json' },
+            body: JSON.stringify(pc.localDescription)
+        });
+        if (!response.ok) {
+            throw new Error(`HTTP ${response.status}`);
         }
-        
-        .video-stream {
-            width: 100%;
-            height: 100%;
-            object-fit: cover;
+        const answer = await response.json();
+        if (peers[streamId] === pc) {
+            await pc.setRemoteDescription(answer);
         }
-        
-        .stream-status {
-            position: absolute;
-            top: 10px;
-            right: 10px;
-            background: rgba(0,0,0,0.7);
-            color: white;
-            padding: 5px 10px;
-            border-radius: 15px;
-            font-size: 12px;
+    } catch (error) {
+        console.error('WebRTC failed, using the HTTP stream:', error);
+        if (peers[streamId] === pc) {
+            fallBackFromWebRTC(streamId);
         }
-        
-        .status-online {
-            background: rgba(0,200,0,0.8);
+    }
+}
+
+function iceGatheringComplete(pc) {
+    return new Promise(resolve => {
+        if (pc.iceGatheringState === 'complete') {
+            resolve();
+            return;
         }
-        
-        .status-offline {
-            background: rgba(200,0,0,0.8);
+        pc.addEventListener('icegatheringstatechange', () => {
+            if (pc.iceGatheringState === 'complete') {
+                resolve();
+            }
+        });
+    });
+}
+
+function fallBackFromWebRTC(streamId) {
+    webrtcFailed.add(streamId);
+    closePeer(streamId);
+    startStream(streamId);
+}
+
+function closePeer(streamId) {
+    const pc = peers[streamId];
+    if (pc) {
+        delete peers[streamId];
+        pc.close();
+        document.getElementById(`video-${streamId}`).srcObject = null;
+    }
+}
+
+// Stop a video stream
+function stopStream(streamId) {
+    const videoElement = document.getElementById(`video-${streamId}`);
+
+    closePeer(streamId);
+    stopMJPEG(streamId);
+    videoElement.onerror = null;
+    videoElement.removeAttribute('src');
+    videoElement.load();
+    setStatus(streamId, false);
+    streamStates[streamId] = false;
+    hideError(streamId);
+}
+
+// Toggle stream on/off
+function toggleStream(streamId) {
+    if (streamStates[streamId]) {
+        stopStream(streamId);
+        stoppedStreams.add(streamId);
+    } else {
+        startStream(streamId);
+    }
+}
+
+// Enlarge a tile to full resolution, or shrink it back to the grid
+function toggleEnlarge(streamId) {
+    const box = document.getElementById(streamId).closest('.stream-box');
+    box.classList.toggle('enlarged');
+    // HLS video has a single tier; MJPEG tiles switch URL and WebRTC starts or stops
+    if (streamStates[streamId] && (streams[streamId].transport !== 'video' || streams[streamId].webrtc)) {
+        startStream(streamId);
+    }
+}
+
+// Refresh a stream
+function refreshStream(streamId) {
+    // A manual refresh gives WebRTC another chance
+    webrtcFailed.delete(streamId);
+    // The relay keeps the camera connected, so there's nothing to wait for in between
+    stopStream(streamId);
+    startStream(streamId);
+}
+
+// Show error message
+function showError(streamId, message) {
+    const errorElement = document.getElementById(`error-${streamId}`);
+    errorElement.textContent = message;
+    errorElement.style.display = 'block';
+}
+
+// Hide error message
+function hideError(streamId) {
+    const errorElement = document.getElementById(`error-${streamId}`);
+    errorElement.style.display = 'none';
+}
+
+function showRecording(streamId, active) {
+    document.getElementById(`rec-${streamId}`).style.display = active ? 'block' : 'none';
+}
+
+// Highlight the cameras that currently see movement
+function showMotion(streamId, active) {
+    document.getElementById(streamId).closest('.stream-box').classList.toggle('motion', !!active);
+}
+
+// Ask the server to save this camera's last few seconds and what follows
+async function recordStream(streamId) {
+    try {
+        const response = await fetch(`/api/streams/${streamId}/record`, { method: 'POST' });
+        if (!response.ok) {
+            showError(streamId, response.status === 409
+                ? 'Recording is not enabled on the server.'
+                : 'Failed to start recording.');
         }
-        
-        .controls {
-            margin-top: 10px;
-            text-align: center;
+    } catch (error) {
+        showError(streamId, 'Failed to start recording.');
+    }
+}
+
+function updateStream(streamId, info) {
+    if (streams[streamId]) {
+        Object.assign(streams[streamId], info);
+    }
+}
+
+function showStats(streamId, stats) {
+    const statsElement = document.getElementById(`stats-${streamId}`);
+    if (!statsElement) {
+        return;
+    }
+    if (!stats.fps) {
+        statsElement.textContent = '';
+        return;
+    }
+    const rate = stats.kbps >= 1000 ? `${(stats.kbps / 1000).toFixed(1)} Mbps` : `${stats.kbps} kbps`;
+    statsElement.textContent = `${stats.fps} fps · ${rate}`;
+}
+
+// Follow status and stats pushed by the server; poll only without EventSource
+function subscribeEvents() {
+    if (!window.EventSource) {
+        setInterval(pollStatus, STATUS_POLL_MS);
+        return;
+    }
+    const source = eventSource = new EventSource('/api/events');
+    source.addEventListener('snapshot', event => {
+        const status = JSON.parse(event.data);
+        Object.keys(status).forEach(streamId => updateStream(streamId, status[streamId]));
+        applyStatus();
+    });
+    source.addEventListener('status', event => {
+        const info = JSON.parse(event.data);
+        updateStream(info.stream, info);
+        applyStatus();
+    });
+    source.addEventListener('stats', event => {
+        const stats = JSON.parse(event.data);
+        Object.keys(stats).forEach(streamId => showStats(streamId, stats[streamId]));
+    });
+    source.addEventListener('recording', event => {
+        const info = JSON.parse(event.data);
+        updateStream(info.stream, { recording: info.active });
+        showRecording(info.stream, info.active);
+    });
+    source.addEventListener('motion', event => {
+        const info = JSON.parse(event.data);
+        updateStream(info.stream, { motion: info.active });
+        showMotion(info.stream, info.active);
+    });
+    source.addEventListener('config', event => {
+        // Streams were added or removed: the server has re-rendered the page
+        const streamIds = JSON.parse(event.data).streams;
+        if (streamIds.join() !== Object.keys(streamStates).join()) {
+            location.reload();
         }
-        
-        .btn {
-            background: #007bff;
-            color: white;
-            border: none;
-            padding: 8px 16px;
-            border-radius: 4px;
-            cursor: pointer;
-            margin: 0 5px;
-            font-size: 14px;
+    });
+}
+
+// Offset of the blank line ending a multipart part's headers, or -1
+function findHeaderEnd(bytes) {
+    for (let i = 0; i + 3 < bytes.length; i++) {
+        if (bytes[i] === 13 && bytes[i + 1] === 10 && bytes[i + 2] === 13 && bytes[i + 3] === 10) {
+            return i;
         }
-        
-        .btn:hover {
-            background: #0056b3;
+    }
+    return -1;
+}
+
+function parsePartHeaders(text) {
+    const headers = {};
+    text.split('\\r\\n').forEach(line => {
+        const colon = line.indexOf(':');
+        if (colon > 0) {
+            headers[line.slice(0, colon).trim().toLowerCase()] = line.slice(colon + 1).trim();
         }
-        
-        .error-message {
-            color: #dc3545;
-            text-align: center;
-            padding: 20px;
-            background: rgba(220,53,69,0.1);
-            border-radius: 4px;
-            margin-top: 10px;
+    });
+    return {
+        length: parseInt(headers['content-length'], 10),
+        timestamp: parseFloat(headers['x-timestamp']),
+        captured: headers['x-capture-timestamp'] ? parseFloat(headers['x-capture-timestamp']) : null,
+    };
+}
+
+// Read a few frames of a tile's stream alongside its <img> and report how old they were once decoded
+async function probeLatency(streamId) {
+    const info = streams[streamId];
+    const imgElement = document.getElementById(streamId);
+    if (!info || !info.latency || !liveStreams.has(streamId) || imgElement.style.display === 'none') {
+        return;
+    }
+    const enlarged = imgElement.closest('.stream-box').classList.contains('enlarged');
+    const controller = new AbortController();
+    const timer = setTimeout(() => controller.abort(), LATENCY_PROBE_FRAMES * 2000);
+    const samples = [];
+    try {
+        const requested = Date.now();
+        const response = await fetch(enlarged ? info.url : info.thumb, { signal: controller.signal });
+        // Our clock minus the server's, accurate to half the round trip
+        const offset = (requested + Date.now()) / 2000 - parseFloat(response.headers.get('X-Server-Time'));
+        if (!response.ok || isNaN(offset)) {
+            return;
         }
-        
-        @media (max-width: 768px) {
-            .streams-container {
-                grid-template-columns: 1fr;
+        const reader = response.body.getReader();
+        let buffer = new Uint8Array(0);
+        let part = null;
+        let parts = 0;
+        while (samples.length < LATENCY_PROBE_FRAMES) {
+            const { value, done } = await reader.read();
+            if (done) {
+                break;
+            }
+            const joined = new Uint8Array(buffer.length + value.length);
+            joined.set(buffer);
+            joined.set(value, buffer.length);
+            buffer = joined;
+            while (samples.length < LATENCY_PROBE_FRAMES) {
+                if (!part) {
+                    const end = findHeaderEnd(buffer);
+                    if (end < 0) {
+                        break;
+                    }
+                    part = parsePartHeaders(new TextDecoder().decode(buffer.subarray(0, end)));
+                    buffer = buffer.subarray(end + 4);
+                }
+                if (isNaN(part.length) || buffer.length < part.length) {
+                    break;
+                }
+                const jpeg = buffer.slice(0, part.length);
+                buffer = buffer.subarray(part.length);
+                const bitmap = await createImageBitmap(new Blob([jpeg], { type: 'image/jpeg' }));
+                bitmap.close();
+                const now = Date.now() / 1000 - offset;
+                // The first part is the relay's buffered frame, which a live viewer would have had earlier
+                if (parts++ > 0 && !isNaN(part.timestamp)) {
+                    samples.push({
+                        browser: now - part.timestamp,
+                        glass: part.captured != null ? now - part.captured : null,
+                    });
+                }
+                part = null;
+            }
+        }
+    } catch (error) {
+        // Aborted or not supported by this browser; try again next round
+    } finally {
+        clearTimeout(timer);
+        controller.abort();
+    }
+    if (samples.length) {
+        fetch(info.latency, {
+            method: 'POST',
+            headers: { 'Content-Type': 'application/json' },
+            body: JSON.stringify({ tier: enlarged ? 'full' : 'thumb', samples }),
+        }).catch(() => {});
+    }
+}
+
+// Sample one tile after another so probes never pile up on the server
+async function probeAllLatency() {
+    if (document.hidden || !window.ReadableStream || !window.createImageBitmap) {
+        return;
+    }
+    for (const streamId of Object.keys(streamStates)) {
+        if (streamStates[streamId]) {
+            await probeLatency(streamId);
+        }
+    }
+}
+
+// Pause streams whose tiles are scrolled out of view, so the server can disconnect idle cameras
+function observeVisibility() {
+    if (!window.IntersectionObserver) {
+        return;
+    }
+    const observer = new IntersectionObserver(entries => {
+        entries.forEach(entry => {
+            const streamId = entry.target.querySelector('.video-container').dataset.stream;
+            if (entry.isIntersecting) {
+                hiddenStreams.delete(streamId);
+                if (!streamStates[streamId] && !stoppedStreams.has(streamId)) {
+                    applyStatus();
+                }
+            } else {
+                hiddenStreams.add(streamId);
+                if (streamStates[streamId]) {
+                    stopStream(streamId);
+                }
             }
-            
-            .video-container {
-                height: 250px;
+        });
+    });
+    document.querySelectorAll('.stream-box').forEach(box => observer.observe(box));
+}
+
+// A background tab hands its connections back to the tabs in front
+function observeTabVisibility() {
+    document.addEventListener('visibilitychange', () => {
+        if (document.hidden) {
+            Object.keys(streamStates).forEach(streamId => {
+                if (streamStates[streamId]) {
+                    stopStream(streamId);
+                }
+            });
+            if (eventSource) {
+                eventSource.close();
+                eventSource = null;
             }
+        } else if (window.EventSource && !eventSource) {
+            // The event stream's snapshot restarts the tiles
+            subscribeEvents();
+        } else {
+            applyStatus();
         }
-    </style>
+    });
+}
+
+// Initialize when page loads
+window.onload = async function() {
+    observeVisibility();
+    observeTabVisibility();
+    await pollStatus();
+    subscribeEvents();
+    setInterval(probeAllLatency, LATENCY_PROBE_MS);
+};
+"""
+
+
+PAGE_TEMPLATE = """<!DOCTYPE html>
+<html lang="en">
+<head>
+    <meta charset="UTF-8">
+    <meta name="viewport" content="width=device-width, initial-scale=1.0">
+    <title>Raspberry Pi Video Streams</title>
+    <link rel="stylesheet" href="{stylesheet}">
+    <script src="{script}" defer></script>
 </head>
 <body>
     <div class="header">
-        <h1>🍓 Raspberry Pi Video Streams</h1>
-        <p>Live video feeds from remote Raspberry Pi devices</p>
-    </div>
-    
-    <div class="streams-container">
-        <div class="stream-box">
-            <div class="stream-title">📹 Shed - piir</div>
-            <div class="video-container">
-                <img id="stream1" class="video-stream" src="" alt="Video Stream 1">
-                <div id="status1" class="stream-status status-offline">Offline</div>
-            </div>
-            <div class="controls">
-                <button class="btn" onclick="toggleStream('stream1')">Toggle Stream</button>
-                <button class="btn" onclick="refreshStream('stream1')">Refresh</button>
-            </div>
-            <div id="error1" class="error-message" style="display: none;"></div>
-        </div>
-        
-        <div class="stream-box">
-            <div class="stream-title">📹 BackDoor - pipiw</div>
-            <div class="video-container">
-                <img id="stream2" class="video-stream" src="" alt="Video Stream 2">
-                <div id="status2" class="stream-status status-offline">Offline</div>
-            </div>
-            <div class="controls">
-                <button class="btn" onclick="toggleStream('stream2')">Toggle Stream</button>
-                <button class="btn" onclick="refreshStream('stream2')">Refresh</button>
-            </div>
-            <div id="error2" class="error-message" style="display: none;"></div>
-        </div>
-        
-        <div class="stream-box">
-            <div class="stream-title">📹 FrontDoor - picam</div>
-            <div class="video-container">
-                <img id="stream3" class="video-stream" src="" alt="Video Stream 3">
-                <div id="status3" class="stream-status status-offline">Offline</div>
-            </div>
-            <div class="controls">
-                <button class="btn" onclick="toggleStream('stream3')">Toggle Stream</button>
-                <button class="btn" onclick="refreshStream('stream3')">Refresh</button>
-            </div>
-            <div id="error3" class="error-message" style="display: none;"></div>
-        </div>
+        <h1>🍓 Raspberry Pi Video Streams</h1>
+        <p>Live video feeds from remote Raspberry Pi devices</p>
+    </div>
+    
+    <div class="streams-container" data-live-streams="{live_streams}">
+<!-- STREAM_BOXES -->
         <audio id="backgroundAudio" autoplay loop controls style="position: fixed; bottom: 10px; right: 10px; z-index: 1000; opacity: 0.8;">
             <source src="https://playerservices.streamtheworld.com/api/livestream-redirect/KPLZFMAAC.aac" type="audio/aac">
             <source src="https://playerservices.streamtheworld.com/api/livestream-redirect/KPLZFM.mp3" type="audio/mpeg">
@@ -233,180 +4202,1585 @@ class VideoStreamHandler(http.server.SimpleHTTPRequestHandler):
             Your browser does not support the audio element.
         </audio>
     </div>
+</body>
+</html>"""
 
-    <script>
-        let streamUrls = {};
-        let streamStates = {
-            stream1: false,
-            stream2: false,
-            stream3: false
-        };
-
-        // Load stream configuration
-        async function loadStreamConfig() {
-            try {
-                const response = await fetch('/api/streams');
-                streamUrls = await response.json();
-                console.log('Stream URLs loaded:', streamUrls);
-            } catch (error) {
-                console.error('Failed to load stream configuration:', error);
-            }
-        }
 
-        // Initialize streams
-        function initializeStreams() {
-            Object.keys(streamStates).forEach(streamId => {
-                if (streamUrls[streamId]) {
-                    startStream(streamId);
-                }
-            });
-        }
+def minify_css(css):
+    """Strip comments and the whitespace around CSS punctuation"""
+    css = re.sub(r'/\*.*?\*/', '', css, flags=re.S)
+    css = re.sub(r'\s+', ' ', css)
+    css = re.sub(r'\s*([{};:,>])\s*', r'\1', css)
+    return css.replace(';}', '}').strip()
 
-        // Start a video stream
-        function startStream(streamId) {
-            const imgElement = document.getElementById(streamId);
-            const statusElement = document.getElementById(`status${streamId.slice(-1)}`);
-            const errorElement = document.getElementById(`error${streamId.slice(-1)}`);
-            
-            if (!streamUrls[streamId]) {
-                showError(streamId, 'Stream URL not configured');
-                return;
-            }
 
-            // Add timestamp to prevent caching
-            const streamUrl = streamUrls[streamId] + '?t=' + new Date().getTime();
-            
-            imgElement.onload = function() {
-                statusElement.textContent = 'Online';
-                statusElement.className = 'stream-status status-online';
-                hideError(streamId);
-                streamStates[streamId] = true;
-            };
-            
-            imgElement.onerror = function() {
-                statusElement.textContent = 'Offline';
-                statusElement.className = 'stream-status status-offline';
-                showError(streamId, 'Failed to load stream. Check if Raspberry Pi is online.');
-                streamStates[streamId] = false;
-                
-                // Retry after 5 seconds
-                setTimeout(() => {
-                    if (streamStates[streamId] === false) {
-                        refreshStream(streamId);
-                    }
-                }, 5000);
-            };
-            
-            imgElement.src = streamUrl;
-        }
+def minify_js(js):
+    """Drop indentation, blank lines and whole-line comments
 
-        // Stop a video stream
-        function stopStream(streamId) {
-            const imgElement = document.getElementById(streamId);
-            const statusElement = document.getElementById(`status${streamId.slice(-1)}`);
-            
-            imgElement.src = '';
-            statusElement.textContent = 'Offline';
-            statusElement.className = 'stream-status status-offline';
-            streamStates[streamId] = false;
-            hideError(streamId);
-        }
+    Deliberately conservative: anything subtler needs a real JavaScript parser
+    to stay safe around strings and automatic semicolon insertion, and the
+    gzip/brotli variants do most of the shrinking anyway.
+    """
+    lines = (line.strip() for line in js.splitlines())
+    return '\n'.join(line for line in lines if line and not line.startswith('//'))
 
-        // Toggle stream on/off
-        function toggleStream(streamId) {
-            if (streamStates[streamId]) {
-                stopStream(streamId);
-            } else {
-                startStream(streamId);
-            }
-        }
 
-        // Refresh a stream
-        function refreshStream(streamId) {
-            if (streamStates[streamId]) {
-                stopStream(streamId);
-                setTimeout(() => startStream(streamId), 500);
-            } else {
-                startStream(streamId);
-            }
-        }
+def build_page_assets():
+    """The page's stylesheet and script, minified and named after their content"""
+    assets = {}
+    for kind, source, content_type in (('css', minify_css(PAGE_CSS), 'text/css; charset=utf-8'),
+                                       ('js', minify_js(PAGE_JS), 'text/javascript; charset=utf-8')):
+        asset = RenderedPage(source, content_type)
+        asset.name = f'app.{asset.digest[:10]}.{kind}'
+        assets[kind] = asset
+    return assets
 
-        // Show error message
-        function showError(streamId, message) {
-            const errorElement = document.getElementById(`error${streamId.slice(-1)}`);
-            errorElement.textContent = message;
-            errorElement.style.display = 'block';
-        }
 
-        // Hide error message
-        function hideError(streamId) {
-            const errorElement = document.getElementById(`error${streamId.slice(-1)}`);
-            errorElement.style.display = 'none';
-        }
+def render_main_page(config, assets):
+    """Build the main HTML page with one stream box per configured stream"""
+    streams = config.get('streams', {})
+    boxes = ''.join(
+        STREAM_BOX_TEMPLATE.format(id=html.escape(stream_id),
+                                   name=html.escape(info.get('name', stream_id)))
+        for stream_id, info in streams.items())
+    live_streams = config.get('relay', {}).get('live_streams', PAGE_LIVE_STREAMS)
+    if not isinstance(live_streams, int) or isinstance(live_streams, bool) or live_streams < 0:
+        print(f"⚠️  Unsupported live_streams {live_streams}, using {PAGE_LIVE_STREAMS}")
+        live_streams = PAGE_LIVE_STREAMS
+    return (PAGE_TEMPLATE.replace('<!-- STREAM_BOXES -->\n', boxes)
+            .replace('{live_streams}', str(live_streams))
+            .replace('{stylesheet}', f"/static/{assets['css'].name}")
+            .replace('{script}', f"/static/{assets['js'].name}"))
 
-        // Auto-refresh streams every 30 seconds if they're offline
-        function autoRefresh() {
-            Object.keys(streamStates).forEach(streamId => {
-                if (!streamStates[streamId]) {
-                    refreshStream(streamId);
-                }
-            });
+
+class RenderedPage:
+    """A page encoded once, with pre-compressed variants and content-hash ETags"""
+
+    def __init__(self, html, content_type='text/html; charset=utf-8'):
+        body = html.encode()
+        self.content_type = content_type
+        self.variants = {
+            'identity': body,
+            'gzip': gzip.compress(body, compresslevel=9, mtime=0),
         }
+        if brotli is not None:
+            self.variants['br'] = brotli.compress(body, quality=11)
+        self.digest = hashlib.sha256(body).hexdigest()[:16]
 
-        // Initialize when page loads
-        window.onload = async function() {
-            await loadStreamConfig();
-            initializeStreams();
-            
-            // Set up auto-refresh
-            setInterval(autoRefresh, 30000);
-        };
-    </script>
-</body>
-</html>"""
+    def etag(self, encoding):
+        """Strong ETag for one encoded variant"""
+        if encoding == 'identity':
+            return f'"{self.digest}"'
+        return f'"{self.digest}-{encoding}"'
+
+    def negotiate(self, accept_encoding):
+        """Pick the smallest variant the client accepts"""
+        accepted, refused = set(), set()
+        for item in accept_encoding.split(','):
+            coding, _, params = item.strip().partition(';')
+            coding = coding.strip().lower()
+            q = params.strip()
+            if q.startswith('q='):
+                try:
+                    if float(q[2:]) == 0:
+                        refused.add(coding)
+                        continue
+                except ValueError:
+                    continue
+            accepted.add(coding)
+        for encoding in ('br', 'gzip'):
+            # The wildcard stands for every coding not named explicitly, so no refused one
+            if encoding in self.variants and encoding not in refused and (encoding in accepted or '*' in accepted):
+                return encoding
+        return 'identity'
+
+    @staticmethod
+    def matches(if_none_match, etag):
+        """True when an If-None-Match header matches the given ETag"""
+        if not if_none_match:
+            return False
+        for tag in if_none_match.split(','):
+            tag = tag.strip()
+            if tag == '*' or tag.removeprefix('W/') == etag:
+                return True
+        return False
+
+
+class StaticFile:
+    """One file under the static root; small files carry their contents"""
+
+    def __init__(self, path, stat, data=None):
+        self.path = path
+        self.size = stat.st_size
+        self.mtime_ns = stat.st_mtime_ns
+        self.data = data
+        self.checked = time.monotonic()
+        self.etag = f'"{self.mtime_ns:x}-{self.size:x}"'
+        self.last_modified = email.utils.formatdate(stat.st_mtime, usegmt=True)
+        self.content_type = mimetypes.guess_type(path)[0] or 'application/octet-stream'
+        self.immutable = STATIC_FINGERPRINT.search(os.path.basename(path)) is not None
+
+
+class StaticFiles:
+    """Files under one directory, with an LRU cache of the small ones
+
+    A cached file is re-stat()ed at most every few seconds, so edits still show
+    up without a restart. Files too big to cache are looked up the same way but
+    streamed from disk with sendfile.
+    """
+
+    def __init__(self, root, max_bytes=STATIC_CACHE_BYTES, max_file_bytes=STATIC_CACHE_FILE_BYTES):
+        self.root = os.path.realpath(root)
+        self.max_bytes = max_bytes
+        self.max_file_bytes = max_file_bytes
+        self._files = collections.OrderedDict()
+        self._bytes = 0
+        self._lock = threading.Lock()
+
+    def resolve(self, name):
+        """Filesystem path for a request path under the root, or None if it escapes it"""
+        parts = name.split('/')
+        if not name or '\\' in name or '\0' in name or any(not p or p.startswith('.') for p in parts):
+            return None
+        path = os.path.realpath(os.path.join(self.root, *parts))
+        return path if path.startswith(self.root + os.sep) else None
+
+    def lookup(self, name):
+        """Current StaticFile for a request path, or None if there's no such file"""
+        now = time.monotonic()
+        with self._lock:
+            entry = self._files.get(name)
+            if entry is not None and now - entry.checked < STATIC_REVALIDATE_SECONDS:
+                self._files.move_to_end(name)
+                return entry
+
+        path = self.resolve(name)
+        try:
+            stat = os.stat(path) if path else None
+        except OSError:
+            stat = None
+        if stat is None or not os.path.isfile(path):
+            self._evict(name)
+            return None
+        if entry is not None and (entry.mtime_ns, entry.size) == (stat.st_mtime_ns, stat.st_size):
+            entry.checked = now
+            return entry
+
+        data = None
+        if stat.st_size <= self.max_file_bytes:
+            try:
+                with open(path, 'rb') as f:
+                    data = f.read()
+            except OSError:
+                return None
+        entry = StaticFile(path, stat, data)
+        with self._lock:
+            self._remove(name)
+            self._files[name] = entry
+            self._bytes += len(data or b'')
+            while self._bytes > self.max_bytes and len(self._files) > 1:
+                self._remove(next(iter(self._files)))
+        return entry
+
+    def _evict(self, name):
+        with self._lock:
+            self._remove(name)
+
+    def _remove(self, name):
+        entry = self._files.pop(name, None)
+        if entry is not None:
+            self._bytes -= len(entry.data or b'')
+
+
+def parse_range(header, size):
+    """(start, end) of a single 'bytes=' Range header, None to ignore it, False if unsatisfiable"""
+    unit, _, spec = header.partition('=')
+    # Multi-range requests are rare enough to just answer with the whole file
+    if unit.strip().lower() != 'bytes' or ',' in spec:
+        return None
+    first, _, last = spec.strip().partition('-')
+    try:
+        if not first:
+            start, end = max(size - int(last), 0), size
+        else:
+            start, end = int(first), min(int(last) + 1, size) if last else size
+    except ValueError:
+        return None
+    if start < 0 or start >= end:
+        return False
+    return start, end
+
+
+class VideoStreamHandler(http.server.BaseHTTPRequestHandler):
+    # Persistent connections; every response carries a Content-Length or closes
+    protocol_version = 'HTTP/1.1'
+
+    @property
+    def video_streams(self):
+        """Stream URLs from the process-wide config cache"""
+        return self.server.config.video_streams
+
+    def setup(self):
+        settings = self.server.config.server
+        keepalive = settings.get('keepalive_timeout', KEEPALIVE_TIMEOUT)
+        self.timeout = keepalive or REQUEST_LINE_TIMEOUT
+        self.max_requests = settings.get('keepalive_requests', KEEPALIVE_MAX_REQUESTS) if keepalive else 1
+        # A pooled server parks idle connections between requests; pick up the count
+        idle_connections = getattr(self.server, 'idle_connections', None)
+        self.parkable = idle_connections is not None
+        self.requests_served = idle_connections.pop(self.request, 0) if self.parkable else 0
+        self.idle = False
+        self.detached = False
+        super().setup()
+
+    def handle(self):
+        """Serve requests until the client closes, idles out or reaches max_requests"""
+        self.close_connection = True
+        self.handle_one_request()
+        while not self.close_connection:
+            if self.parkable and not self._pipelined():
+                # Hand the connection back to the dispatcher instead of holding a worker
+                self.idle = True
+                return
+            self.handle_one_request()
+
+    def _pipelined(self):
+        """Whether the client has already sent part of its next request"""
+        self.connection.setblocking(False)
+        try:
+            return bool(self.rfile.peek(1))
+        except OSError:
+            return False
+        finally:
+            self.connection.settimeout(self.timeout)
+
+    def send_response(self, code, message=None):
+        self.status_code = code
+        self.requests_served += 1
+        super().send_response(code, message)
+
+    def end_headers(self):
+        # A draining server closes kept-alive connections as their requests finish
+        if not self.close_connection and (self.requests_served >= self.max_requests or self.server.draining):
+            self.send_header('Connection', 'close')
+        super().end_headers()
+
+    def send_stream_headers(self):
+        """End the headers of a response that lasts until the client goes away"""
+        # There's no length to frame an endless body with, so it ends the connection
+        self.send_header('Connection', 'close')
+        self.end_headers()
+        self.connection.settimeout(None)
+
+    def _begin_request(self):
+        self.status_code = None
+        self.error_message = None
+        self.in_request = True
+        self.server.request_begun()
+        self.request_started = time.perf_counter()
+        return self.request_started
+
+    def log_request(self, code='-', size='-'):
+        # Requests routed by do_GET/do_POST are logged once they finish, with their duration
+        if not getattr(self, 'in_request', False):
+            self._log_access(None, None, code)
+
+    def log_error(self, format, *args):
+        message = format % args
+        if getattr(self, 'in_request', False):
+            # Folded into the request's own access log entry
+            self.error_message = message
+        else:
+            # An idle keep-alive connection timing out is routine
+            level = 'debug' if format.startswith('Request timed out') else 'warning'
+            self._log(level, {'client': self.client_address[0], 'message': message})
+
+    def log_message(self, format, *args):
+        self._log('info', {'client': self.client_address[0], 'message': format % args})
+
+    def _log(self, level, record):
+        access_log = getattr(self.server, 'access_log', None)
+        if access_log is not None:
+            access_log.log(level, record)
+
+    def _log_access(self, route, duration, code):
+        code = code if isinstance(code, int) else getattr(code, 'value', None)
+        # A malformed request line may fail before there's a command or path
+        record = {'client': self.client_address[0], 'method': getattr(self, 'command', None),
+                  'path': getattr(self, 'path', None), 'status': code}
+        if route is not None:
+            record['route'] = route
+            record['duration_ms'] = round(duration * 1000, 2)
+        if getattr(self, 'error_message', None):
+            record['error'] = self.error_message
+            self.error_message = None
+        level = 'error' if code and code >= 500 else 'warning' if code and code >= 400 else 'info'
+        self._log(level, record)
+
+    def do_GET(self):
+        self.route_get(head=False)
+
+    def do_HEAD(self):
+        self.route_get(head=True)
+
+    def route_get(self, head):
+        """Route a GET, or a HEAD that gets the same headers without the body"""
+        parsed_path = urlparse(self.path)
+        started = self._begin_request()
+        route = 'other'
         
+        try:
+            if parsed_path.path == '/':
+                route = '/'
+                self.serve_main_page(head)
+            elif parsed_path.path == '/api/streams':
+                route = '/api/streams'
+                self.serve_stream_config(head)
+            elif parsed_path.path == '/api/events':
+                route = '/api/events'
+                if head:
+                    self.send_get_only()
+                else:
+                    self.serve_events()
+            elif parsed_path.path.startswith('/api/streams/') and parsed_path.path.endswith('/snapshot.jpg'):
+                route = '/api/streams/<id>/snapshot.jpg'
+                self.serve_snapshot(parsed_path.path[len('/api/streams/'):-len('/snapshot.jpg')], head)
+            elif parsed_path.path.startswith('/relay/'):
+                route = '/relay/<id>'
+                stream_id, _, variant = parsed_path.path[len('/relay/'):].partition('/')
+                if head:
+                    self.send_get_only()
+                else:
+                    self.serve_relay(stream_id, variant, parse_qs(parsed_path.query))
+            elif parsed_path.path.startswith('/hls/'):
+                route = '/hls/<id>'
+                stream_id, _, name = parsed_path.path[len('/hls/'):].partition('/')
+                self.serve_hls(stream_id, name, head)
+            elif parsed_path.path == '/metrics':
+                route = '/metrics'
+                self.serve_metrics(head)
+            elif parsed_path.path.startswith('/static/'):
+                route = '/static/'
+                self.serve_static(unquote(parsed_path.path[len('/static/'):]), head)
+            else:
+                self.send_error(404, "Not found")
+        finally:
+            # A viewer handed to the relay loop is counted once it leaves
+            if not self.detached:
+                self._count_request(route, started)
+
+    def send_get_only(self):
+        """Refuse a HEAD of an endless stream, whose headers are only sent as it starts"""
+        self.send_response(405)
+        self.send_header('Allow', 'GET')
+        self.send_header('Content-Length', '0')
+        self.end_headers()
+
+    def do_POST(self):
+        parsed_path = urlparse(self.path)
+        started = self._begin_request()
+        route = 'other'
+
+        try:
+            if parsed_path.path.startswith('/api/streams/') and parsed_path.path.endswith('/record'):
+                route = '/api/streams/<id>/record'
+                self.record_stream(parsed_path.path[len('/api/streams/'):-len('/record')])
+            elif parsed_path.path.startswith('/api/streams/') and parsed_path.path.endswith('/webrtc'):
+                route = '/api/streams/<id>/webrtc'
+                self.answer_webrtc(parsed_path.path[len('/api/streams/'):-len('/webrtc')])
+            elif parsed_path.path.startswith('/api/streams/') and parsed_path.path.endswith('/latency'):
+                route = '/api/streams/<id>/latency'
+                self.record_latency(parsed_path.path[len('/api/streams/'):-len('/latency')])
+            else:
+                self.send_error(404, "Not found")
+        finally:
+            self._count_request(route, started)
+
+    def finish_detached(self):
+        """Log and close a relay response the relay loop took over, once its viewer has gone"""
+        self._count_request('/relay/<id>', self.request_started)
+        self.server.shutdown_request(self.connection)
+
+    def _count_request(self, route, started):
+        self.in_request = False
+        self.server.request_ended()
+        duration = time.perf_counter() - started
+        labels = (('route', route),)
+        METRICS.inc('streamserver_requests_total', labels + (('code', self.status_code),))
+        # A stream's duration is how long someone watched, not how fast it was served
+        if not route.startswith(('/relay/', '/api/events')):
+            METRICS.observe('streamserver_request_duration_seconds', labels, duration)
+        self._log_access(route, duration, self.status_code)
+    
+    def serve_metrics(self, head=False):
+        """Serve Prometheus metrics"""
+        body = self.server.render_metrics().encode()
         self.send_response(200)
-        self.send_header('Content-type', 'text/html')
-        self.send_header('Content-Length', len(html_content.encode()))
+        self.send_header('Content-type', 'text/plain; version=0.0.4; charset=utf-8')
+        self.send_header('Content-Length', len(body))
+        self.end_headers()
+        if not head:
+            self.wfile.write(body)
+    
+    def serve_static(self, name, head=False):
+        """Serve a page asset or a file under static/, with conditional and Range requests"""
+        asset = self.server.assets.get(name)
+        if asset is not None:
+            self.send_rendered(asset, f'public, max-age={STATIC_IMMUTABLE_MAX_AGE}, immutable', head)
+            return
+        entry = self.server.static.lookup(name)
+        if entry is None:
+            self.send_error(404, "Not found")
+            return
+
+        if RenderedPage.matches(self.headers.get('If-None-Match'), entry.etag):
+            self.send_response(304)
+            self.send_static_headers(entry)
+            self.end_headers()
+            return
+
+        start, end, status = 0, entry.size, 200
+        range_header = self.headers.get('Range')
+        if_range = self.headers.get('If-Range')
+        if range_header and (if_range is None or if_range == entry.etag):
+            byte_range = parse_range(range_header, entry.size)
+            if byte_range is False:
+                self.send_response(416)
+                self.send_header('Content-Range', f'bytes */{entry.size}')
+                self.send_header('Content-Length', '0')
+                self.end_headers()
+                return
+            if byte_range is not None:
+                (start, end), status = byte_range, 206
+
+        self.send_response(status)
+        self.send_static_headers(entry)
+        self.send_header('Content-type', entry.content_type)
+        if status == 206:
+            self.send_header('Content-Range', f'bytes {start}-{end - 1}/{entry.size}')
+        self.send_header('Content-Length', end - start)
+        self.end_headers()
+        if head or start == end:
+            return
+
+        if entry.data is not None:
+            self.wfile.write(memoryview(entry.data)[start:end])
+            return
+        try:
+            with open(entry.path, 'rb') as f:
+                # Kernel-side copy from the page cache straight to the socket
+                self.connection.sendfile(f, start, end - start)
+        except (BrokenPipeError, ConnectionResetError):
+            self.close_connection = True
+
+    def send_static_headers(self, entry):
+        """Validators and caching policy shared by 200, 206 and 304 responses"""
+        self.send_header('ETag', entry.etag)
+        self.send_header('Last-Modified', entry.last_modified)
+        self.send_header('Accept-Ranges', 'bytes')
+        if entry.immutable:
+            self.send_header('Cache-Control', f'public, max-age={STATIC_IMMUTABLE_MAX_AGE}, immutable')
+        else:
+            self.send_header('Cache-Control', 'no-cache')
+
+    def serve_main_page(self, head=False):
+        """Serve the pre-rendered main page, honouring conditional requests"""
+        # The page is about to open every stream, so start connecting now; a probe won't
+        if not head:
+            self.server.relay_hub.prewarm()
+        self.send_rendered(self.server.main_page, 'no-cache', head)
+
+    def send_rendered(self, page, cache_control, head=False):
+        """Send the best pre-compressed variant of a RenderedPage, or a 304"""
+        encoding = page.negotiate(self.headers.get('Accept-Encoding', ''))
+        etag = page.etag(encoding)
+
+        not_modified = page.matches(self.headers.get('If-None-Match'), etag)
+        self.send_response(304 if not_modified else 200)
+        self.send_header('ETag', etag)
+        self.send_header('Cache-Control', cache_control)
+        self.send_header('Vary', 'Accept-Encoding')
+        if not_modified:
+            self.end_headers()
+            return
+
+        body = page.variants[encoding]
+        self.send_header('Content-type', page.content_type)
+        if encoding != 'identity':
+            self.send_header('Content-Encoding', encoding)
+        self.send_header('Content-Length', len(body))
         self.end_headers()
-        self.wfile.write(html_content.encode())
+        if not head:
+            self.wfile.write(body)
     
-    def serve_stream_config(self):
-        """Serve the stream configuration as JSON"""
+    def serve_stream_config(self, head=False):
+        """Serve the stream configuration and upstream health as JSON"""
+        streams = {}
+        local = self.is_local_client()
+        for stream_id, info in self.server.config.config.get('streams', {}).items():
+            # Browsers are pointed at the local relay rather than the Pi itself
+            entry = {
+                'name': info.get('name', stream_id),
+                'description': info.get('description', ''),
+                'url': f'/relay/{stream_id}',
+                'thumb': f'/relay/{stream_id}/thumb',
+                'snapshot': f'/api/streams/{stream_id}/snapshot.jpg',
+                'latency': f'/api/streams/{stream_id}/latency',
+                'upstream': info.get('url'),
+            }
+            if info.get('peer'):
+                entry['peer'] = info['peer']
+            relay = self.server.relay_hub.get(stream_id)
+            if relay is not None:
+                entry.update(self.server.relay_hub.stream_status(relay))
+                entry['format'] = relay.format
+                webrtc = self.server.relay_hub.webrtc
+                if webrtc is not None and webrtc.supports(relay):
+                    entry['webrtc'] = f'/api/streams/{stream_id}/webrtc'
+                if relay.transcoder is not None:
+                    entry['video'] = {'hls': f'/hls/{stream_id}/index.m3u8',
+                                      'live': f'/relay/{stream_id}/live.mp4'}
+                    # Remote viewers get H.264; the LAN keeps the lower-latency MJPEG
+                    entry['transport'] = 'mjpeg' if local and not relay.passthrough else 'video'
+            streams[stream_id] = entry
+        body = json.dumps(streams, indent=2).encode()
+
         self.send_response(200)
         self.send_header('Content-type', 'application/json')
         self.send_header('Access-Control-Allow-Origin', '*')
+        self.send_header('Cache-Control', 'no-cache')
+        self.send_header('Content-Length', len(body))
         self.end_headers()
-        
-        config_json = json.dumps(self.video_streams, indent=2)
-        self.wfile.write(config_json.encode())
+        if not head:
+            self.wfile.write(body)
+
+    def is_local_client(self):
+        """Whether the client is on the LAN (or this host) rather than the internet"""
+        try:
+            address = ipaddress.ip_address(self.client_address[0])
+        except ValueError:
+            return False
+        return address.is_private or address.is_loopback or address.is_link_local
+
+    def serve_hls(self, stream_id, name, head=False):
+        """Serve the HLS playlist, init segment and media segments of a transcoded stream"""
+        relay = self.server.relay_hub.get(stream_id)
+        transcoder = relay.transcoder if relay is not None else None
+        if transcoder is None:
+            self.send_error(404, f"No HLS output for stream: {stream_id}")
+            return
+        transcoder.touch()
+        ready = transcoder.wait_ready()
+        if ready is None:
+            self.send_transcoder_unavailable()
+            return
+        init, fragments = ready
+
+        if name == 'index.m3u8':
+            playlist = transcoder.playlist(fragments)
+            if playlist is None:
+                self.send_transcoder_unavailable()
+                return
+            body = playlist.encode()
+            content_type, cache = 'application/vnd.apple.mpegurl', 'no-cache'
+        elif name == 'init.mp4':
+            body = init
+            content_type, cache = 'video/mp4', 'no-cache'
+        else:
+            fragment = None
+            if name.startswith('seg') and name.endswith('.m4s') and name[3:-4].isdigit():
+                fragment = transcoder.segment(fragments, int(name[3:-4]))
+            if fragment is None:
+                self.send_error(404, f"Segment not available: {name}")
+                return
+            # A segment's content never changes once published
+            body = fragment.data
+            content_type, cache = 'video/iso.segment', 'max-age=60'
+
+        self.send_response(200)
+        self.send_header('Content-type', content_type)
+        self.send_header('Cache-Control', cache)
+        self.send_header('Access-Control-Allow-Origin', '*')
+        self.send_header('Content-Length', len(body))
+        self.end_headers()
+        if not head:
+            self.wfile.write(body)
+
+    def send_transcoder_unavailable(self):
+        """503 while the encoder is (re)starting, with a retry after about one segment"""
+        self.send_response(503)
+        self.send_header('Retry-After', str(TRANSCODE_SEGMENT_SECONDS))
+        self.send_header('Content-Length', '0')
+        self.end_headers()
+
+    def serve_live_mp4(self, transcoder):
+        """Stream the transcoded video as one endless fragmented MP4 response"""
+        transcoder.touch()
+        ready = transcoder.wait_ready()
+        if ready is None:
+            self.send_transcoder_unavailable()
+            return
+        init, _ = ready
+
+        self.send_response(200)
+        self.send_header('Content-type', 'video/mp4')
+        self.send_header('Cache-Control', 'no-cache, private')
+        self.send_stream_headers()
+
+        subscriber = transcoder.subscribe()
+        try:
+            self.wfile.write(init)
+            while not subscriber.closed:
+                fragment = subscriber.get(timeout=RELAY_RETRY_SECONDS)
+                if fragment is not None:
+                    self.wfile.write(fragment.data)
+        except (BrokenPipeError, ConnectionResetError):
+            pass
+        finally:
+            transcoder.unsubscribe(subscriber)
+
+    def serve_events(self):
+        """Push stream status transitions and live stats as Server-Sent Events"""
+        events = self.server.relay_hub.events
+        self.send_response(200)
+        self.send_header('Content-type', 'text/event-stream')
+        self.send_header('Cache-Control', 'no-cache')
+        self.send_header('Access-Control-Allow-Origin', '*')
+        self.send_stream_headers()
+        # A browser that stops reading without closing would otherwise pin this worker
+        self.connection.settimeout(STREAM_WRITE_TIMEOUT)
+
+        subscriber = events.subscribe()
+        try:
+            # Full state first, so a (re)connecting client never misses a transition
+            self.wfile.write(f'retry: {EVENT_RETRY_MS}\n\n'.encode())
+            self.wfile.write(events.encode('snapshot', self.server.relay_hub.status()))
+            while not subscriber.closed:
+                messages = subscriber.get(timeout=EVENT_HEARTBEAT_SECONDS)
+                # A comment line keeps proxies from timing out an idle stream
+                self.wfile.write(b''.join(messages) if messages else b': keep-alive\n\n')
+            # Whatever was queued before the bus closed, such as the reconnect delay on shutdown
+            self.wfile.write(b''.join(subscriber.get(timeout=0)))
+        except (BrokenPipeError, ConnectionResetError, socket.timeout):
+            pass
+        finally:
+            events.unsubscribe(subscriber)
+
+    def serve_snapshot(self, stream_id, head=False):
+        """Serve the newest relayed frame as a still JPEG without touching the Pi"""
+        relay = self.server.relay_hub.get(stream_id)
+        if relay is None or relay.passthrough:
+            self.send_error(404, f"No snapshots for stream: {stream_id}")
+            return
+        frame = relay.ring.latest()
+        status = relay.health.status
+        if status in ('idle', 'connecting'):
+            # An idle relay's newest frame may be hours old; connect and wait for a fresh one
+            relay.prewarm()
+            frame = relay.ring.wait_newer(frame.seq if frame else 0, RELAY_STALL_SECONDS)
+        elif status != 'online':
+            # The camera is down: say so now rather than tie up a worker for a stale frame
+            frame = None
+        if frame is None:
+            relay.prewarm()
+            retry_in = relay.health.snapshot()['retry_in']
+            self.send_response(503)
+            self.send_header('Retry-After', str(math.ceil(retry_in) if retry_in else RELAY_RETRY_SECONDS))
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            return
+
+        etag = f'"{stream_id}-{frame.seq}"'
+        not_modified = RenderedPage.matches(self.headers.get('If-None-Match'), etag)
+        if not not_modified and 'If-None-Match' not in self.headers:
+            since = self.headers.get('If-Modified-Since')
+            if since:
+                try:
+                    not_modified = int(frame.timestamp) <= email.utils.parsedate_to_datetime(since).timestamp()
+                except (TypeError, ValueError, IndexError, OverflowError):
+                    pass
+
+        self.send_response(304 if not_modified else 200)
+        self.send_header('Last-Modified', self.date_time_string(frame.timestamp))
+        self.send_header('ETag', etag)
+        self.send_header('Cache-Control', 'no-cache')
+        if not_modified:
+            self.end_headers()
+            return
+        self.send_header('Content-type', 'image/jpeg')
+        self.send_header('Content-Length', len(frame.jpeg))
+        self.end_headers()
+        if not head:
+            self.wfile.write(frame.jpeg)
+
+    def record_stream(self, stream_id):
+        """Start or extend a recording of a stream, including its pre-event buffer"""
+        self.discard_body()
+        relay = self.server.relay_hub.get(stream_id)
+        if relay is None:
+            self.send_error(404, f"Unknown stream: {stream_id}")
+            return
+        recorder = relay.recorder
+        if recorder is None:
+            self.send_error(409, "Recording is not enabled in config.json")
+            return
+        try:
+            segment, until = recorder.trigger('api')
+        except LookupError:
+            # A worker's config briefly disagrees with the ingest process's
+            self.send_error(409, "Recording is not enabled in config.json")
+            return
+        except TimeoutError:
+            # The ingest process of a multi-process server didn't answer
+            self.send_response(503)
+            self.send_header('Retry-After', str(WORKER_RPC_SECONDS))
+            self.send_header('Content-Length', '0')
+            self.end_headers()
+            return
+        body = json.dumps({'stream': stream_id, 'file': segment.path,
+                           'until': self.date_time_string(until)}).encode()
+        self.send_response(202)
+        self.send_header('Content-type', 'application/json')
+        self.send_header('Content-Length', len(body))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def record_latency(self, stream_id):
+        """Add latency samples a page measured (JSON {tier, samples: [{browser, glass}]})
+
+        browser is a frame's age in seconds from reaching this server to being
+        decoded in the page, glass from being captured by the camera, when the
+        camera stamps its frames.
+        """
+        relay = self.server.relay_hub.get(stream_id)
+        try:
+            length = int(self.headers.get('Content-Length', 0))
+        except ValueError:
+            length = -1
+        if relay is None:
+            self.discard_body()
+            self.send_error(404, f"Unknown stream: {stream_id}")
+            return
+        if not 0 < length <= LATENCY_REPORT_MAX_BYTES:
+            self.max_requests = 0
+            self.send_error(400, "Expected a JSON latency report with a Content-Length")
+            return
+        try:
+            report = json.loads(self.rfile.read(length))
+            tier = report.get('tier', 'full')
+            samples = report['samples']
+            if tier not in ('full', 'thumb') or not isinstance(samples, list):
+                raise ValueError('not a latency report')
+            samples = [(hop, float(sample[hop])) for sample in samples[:LATENCY_REPORT_MAX_SAMPLES]
+                       for hop in LATENCY_PAGE_HOPS if sample.get(hop) is not None]
+        except (ValueError, TypeError, KeyError, AttributeError):
+            self.send_error(400, "Expected {\"tier\": \"full\", \"samples\": [{\"browser\": seconds}]}")
+            return
+        labels = relay.labels + (('tier', tier),)
+        for hop, seconds in samples:
+            observe_latency(labels, hop, seconds)
+        self.send_response(204)
+        self.end_headers()
+
+    def discard_body(self):
+        """Drop a request body the route ignores, so the next request on the connection parses"""
+        try:
+            length = int(self.headers.get('Content-Length', 0))
+        except ValueError:
+            length = -1
+        if 'Transfer-Encoding' in self.headers or not 0 <= length <= DISCARD_BODY_MAX_BYTES:
+            # Not worth reading; make this the connection's last request instead
+            self.max_requests = 0
+        elif length:
+            self.rfile.read(length)
+
+    def answer_webrtc(self, stream_id):
+        """Answer a browser's WebRTC offer (JSON {sdp, type}) for a stream"""
+        gateway = self.server.relay_hub.webrtc
+        if gateway is None:
+            self.send_error(501, "WebRTC needs aiortc on the server (pip install aiortc)")
+            return
+        relay = self.server.relay_hub.get(stream_id)
+        if relay is None or not gateway.supports(relay):
+            self.send_error(404, f"No WebRTC output for stream: {stream_id}")
+            return
+        try:
+            length = int(self.headers.get('Content-Length', 0))
+        except ValueError:
+            length = -1
+        if not 0 < length <= WEBRTC_MAX_OFFER_BYTES:
+            self.send_error(400, "Expected a JSON offer with a Content-Length")
+            return
+        try:
+            offer = json.loads(self.rfile.read(length))
+            if offer.get('type') != 'offer' or not isinstance(offer.get('sdp'), str):
+                raise ValueError('not an offer')
+        except (ValueError, AttributeError):
+            self.send_error(400, "Expected a JSON offer: {\"type\": \"offer\", \"sdp\": ...}")
+            return
+        try:
+            answer = gateway.answer(relay, offer, '%s:%s' % self.client_address[:2])
+        except Exception as e:
+            print(f"❌ WebRTC negotiation for {stream_id} failed: {e}")
+            self.send_error(500, "WebRTC negotiation failed")
+            return
+        body = json.dumps(answer).encode()
+        self.send_response(200)
+        self.send_header('Content-type', 'application/json')
+        self.send_header('Cache-Control', 'no-store')
+        self.send_header('Content-Length', len(body))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def serve_relay(self, stream_id, variant, query):
+        """Serve a relayed MJPEG stream shared with every other viewer
+
+        The 'thumb' variant serves the downscaled grid tier and 'live.mp4' the
+        transcoded H.264 stream. An optional ?fps= query parameter caps the
+        frame rate sent to an MJPEG viewer.
+        """
+        relay = self.server.relay_hub.get(stream_id)
+        if relay is not None and variant == 'live.mp4' and relay.transcoder is not None:
+            self.serve_live_mp4(relay.transcoder)
+            return
+        if relay is None or variant not in ('', 'thumb'):
+            self.send_error(404, f"Unknown stream: {stream_id}")
+            return
+        if relay.passthrough:
+            self.send_error(404, f"{stream_id} is H.264; use /relay/{stream_id}/live.mp4 or HLS")
+            return
+        if variant == 'thumb':
+            relay = relay.thumbnail()
+
+        max_fps = None
+        if 'fps' in query:
+            try:
+                max_fps = float(query['fps'][0])
+            except ValueError:
+                max_fps = 0
+            if not 0 < max_fps <= 1000:
+                self.send_error(400, "fps must be a positive number")
+                return
+
+        self.send_response(200)
+        self.send_header('Content-type', f'multipart/x-mixed-replace; boundary={RELAY_BOUNDARY}')
+        self.send_header('Cache-Control', 'no-cache, private')
+        self.send_header('Pragma', 'no-cache')
+        self.send_header('Age', '0')
+        # Lets a page align its clock with ours before reading the frames' X-Timestamp
+        self.send_header('X-Server-Time', f'{time.time():.6f}')
+        self.send_stream_headers()
+
+        client = '%s:%s' % self.client_address[:2]
+        relay_loop = getattr(self.server, 'relay_loop', None)
+        if relay_loop is not None:
+            # The relay loop serves the viewer from here on and this worker is free again
+            subscriber = relay.subscribe(max_fps, client, relay_loop)
+            self.connection.setblocking(False)
+            self.detached = True
+            relay_loop.serve_viewer(self, relay, subscriber)
+            return
+
+        subscriber = relay.subscribe(max_fps, client)
+        labels = relay.tier_labels
+        try:
+            while not subscriber.closed:
+                frame = subscriber.get(timeout=RELAY_RETRY_SECONDS)
+                if frame is None:
+                    continue
+                send_buffers(self.connection, frame.buffers)
+                METRICS.inc('streamserver_relay_frames_sent_total', labels)
+                METRICS.inc('streamserver_relay_bytes_sent_total', labels, len(frame.jpeg))
+                observe_latency(labels, 'relay', time.time() - frame.timestamp)
+        except (BrokenPipeError, ConnectionResetError):
+            pass
+        finally:
+            relay.unsubscribe(subscriber)
+
+
+class ConnectionDispatcher(threading.Thread):
+    """Waits for each new connection's request line and routes it to a worker pool
+
+    Connections sit in a selector until the client has actually sent something,
+    so slow or idle clients never tie up a worker. Long-lived streaming routes go
+    to their own pool so they can't starve page and API requests.
+    """
+
+    def __init__(self, server):
+        super().__init__(name='http-dispatcher', daemon=True)
+        self.server = server
+        self._selector = selectors.DefaultSelector()
+        self._incoming = queue.SimpleQueue()
+        self._wake_r, self._wake_w = socket.socketpair()
+        self._wake_r.setblocking(False)
+        self._selector.register(self._wake_r, selectors.EVENT_READ, None)
+        self._closed = False
+
+    def add(self, request, client_address, timeout=REQUEST_LINE_TIMEOUT):
+        self._incoming.put((request, client_address, timeout))
+        self._wake_w.send(b'\0')
+
+    def close(self):
+        self._closed = True
+        self._wake_w.send(b'\0')
+
+    def run(self):
+        pending = {}
+        # Connections whose request line is still incomplete, peeked again on a short timer
+        partial = {}
+        while not self._closed:
+            for key, _ in self._selector.select(timeout=ROUTE_PEEK_INTERVAL if partial else 1.0):
+                if key.data is None:
+                    try:
+                        self._wake_r.recv(4096)
+                    except BlockingIOError:
+                        pass
+                    continue
+                self._selector.unregister(key.fileobj)
+                del pending[key.fileobj]
+                if not self._route(key.fileobj, key.data):
+                    partial[key.fileobj] = (key.data, time.monotonic() + ROUTE_PEEK_SECONDS)
+
+            for request, (client_address, deadline) in list(partial.items()):
+                if self._route(request, client_address, final=time.monotonic() >= deadline):
+                    del partial[request]
+
+            while True:
+                try:
+                    request, client_address, timeout = self._incoming.get_nowait()
+                except queue.Empty:
+                    break
+                pending[request] = time.monotonic() + timeout
+                self._selector.register(request, selectors.EVENT_READ, client_address)
+
+            now = time.monotonic()
+            for request in [r for r, deadline in pending.items() if deadline < now]:
+                self._selector.unregister(request)
+                del pending[request]
+                self.server.shutdown_request(request)
+
+        for request in itertools.chain(pending, partial):
+            self.server.shutdown_request(request)
+        self._selector.close()
+        self._wake_r.close()
+        self._wake_w.close()
+
+    def _route(self, request, client_address, final=False):
+        """Hand a connection to a pool by its request line; False to peek again later"""
+        try:
+            head = request.recv(ROUTE_PEEK_BYTES, socket.MSG_PEEK)
+        except OSError:
+            head = b''
+        if not head:
+            self.server.shutdown_request(request)
+            return True
+        if b'\n' not in head and len(head) < ROUTE_PEEK_BYTES and not final:
+            # The request line arrived split across TCP segments; wait briefly for the rest
+            return False
+
+        parts = head.split(b' ', 2)
+        path = parts[1].decode('latin-1') if len(parts) > 1 else ''
+        if path.startswith(STREAMING_ROUTES):
+            self.server.submit_stream(request, client_address)
+        else:
+            self.server.submit(request, client_address)
+        return True
+
+
+def systemd_socket():
+    """The listening socket systemd passed in (socket activation), or None"""
+    if os.environ.get('LISTEN_PID') != str(os.getpid()):
+        return None
+    try:
+        count = int(os.environ.get('LISTEN_FDS', ''))
+    except ValueError:
+        return None
+    if count < 1:
+        return None
+    if count > 1:
+        print(f"⚠️  systemd passed {count} sockets; serving the first only")
+    # ffmpeg and other children must neither inherit the socket nor think they were activated
+    for name in ('LISTEN_PID', 'LISTEN_FDS', 'LISTEN_FDNAMES'):
+        os.environ.pop(name, None)
+    try:
+        os.set_inheritable(SD_LISTEN_FDS_START, False)
+        return socket.socket(fileno=SD_LISTEN_FDS_START)
+    except OSError as e:
+        print(f"⚠️  Can't use the socket systemd passed in ({e}); binding our own")
+        return None
+
+
+def sd_notify(state):
+    """Tell systemd about startup or shutdown (Type=notify); a no-op otherwise"""
+    address = os.environ.get('NOTIFY_SOCKET')
+    if not address:
+        return
+    if address.startswith('@'):
+        address = '\0' + address[1:]
+    try:
+        with socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM) as sock:
+            sock.sendto(state.encode(), address)
+    except OSError:
+        pass
+
+
+class ServerSocketMixin:
+    """Restart-friendly listening socket, and draining of in-flight requests
+
+    The socket is bound with SO_REUSEADDR, so a restart never waits out
+    TIME_WAIT, and optionally SO_REUSEPORT, so a new process can bind while the
+    old one is still draining. A socket passed in by systemd socket activation
+    is used as is: the kernel queues connections while the service restarts.
+    """
+
+    allow_reuse_address = True
+
+    def __init__(self, *args, reuse_port=False, listen_socket=None, **kwargs):
+        self.reuse_port = reuse_port
+        self.listen_socket = listen_socket
+        self.draining = False
+        self.active_requests = 0
+        self._requests_lock = threading.Lock()
+        super().__init__(*args, **kwargs)
+
+    def server_bind(self):
+        if self.listen_socket is not None:
+            self.socket.close()
+            self.socket = self.listen_socket
+            self.server_address = self.socket.getsockname()
+            self.server_name = socket.getfqdn(self.server_address[0])
+            self.server_port = self.server_address[1]
+            return
+        if self.reuse_port and hasattr(socket, 'SO_REUSEPORT'):
+            self.socket.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+        super().server_bind()
+
+    def request_begun(self):
+        with self._requests_lock:
+            self.active_requests += 1
+
+    def request_ended(self):
+        with self._requests_lock:
+            self.active_requests -= 1
+
+    def stop_accepting(self):
+        """Close the listening socket; new connections go to the next process"""
+        self.draining = True
+        self.socket.close()
+
+    def wait_idle(self, timeout):
+        """Wait up to timeout seconds for in-flight requests; True if they all finished"""
+        deadline = time.monotonic() + timeout
+        while self.active_requests > 0 and time.monotonic() < deadline:
+            time.sleep(DRAIN_POLL_SECONDS)
+        return self.active_requests <= 0
+
+
+class ThreadedHTTPServer(ServerSocketMixin, http.server.ThreadingHTTPServer):
+    """One unbounded thread per connection"""
+
+
+class PooledHTTPServer(ServerSocketMixin, http.server.HTTPServer):
+    """HTTP server backed by two bounded thread pools
+
+    Short page/API requests share `workers` threads; long-lived streaming
+    responses get up to `stream_workers` threads of their own. Streaming
+    clients beyond that limit are turned away with a 503 rather than queued.
+    Kept-alive connections go back to the dispatcher between requests, so an
+    idle browser tab costs a selector entry rather than a worker, and MJPEG
+    relay viewers are handed to the relay loop once their headers are sent.
+    """
+
+    def __init__(self, server_address, handler_class, workers=DEFAULT_WORKERS,
+                 stream_workers=DEFAULT_STREAM_WORKERS, **kwargs):
+        self.stream_workers = stream_workers
+        self._pool = ThreadPoolExecutor(workers, thread_name_prefix='http')
+        self._stream_pool = ThreadPoolExecutor(stream_workers, thread_name_prefix='stream')
+        self._active_streams = 0
+        self._lock = threading.Lock()
+        # Parked keep-alive connections and how many requests each has served
+        self.idle_connections = {}
+        self._dispatcher = ConnectionDispatcher(self)
+        self._dispatcher.start()
+        super().__init__(server_address, handler_class, **kwargs)
+
+    def process_request(self, request, client_address):
+        self._dispatcher.add(request, client_address)
+
+    def submit(self, request, client_address):
+        self._pool.submit(self._process, request, client_address)
+
+    def submit_stream(self, request, client_address):
+        with self._lock:
+            if self._active_streams >= self.stream_workers:
+                busy = True
+            else:
+                busy = False
+                self._active_streams += 1
+        if busy:
+            try:
+                request.sendall(b'HTTP/1.0 503 Service Unavailable\r\n'
+                                b'Retry-After: 5\r\nContent-Length: 0\r\n\r\n')
+            except OSError:
+                pass
+            self.shutdown_request(request)
+            return
+        self._stream_pool.submit(self._process_stream, request, client_address)
+
+    def _process_stream(self, request, client_address):
+        try:
+            self._process(request, client_address)
+        finally:
+            with self._lock:
+                self._active_streams -= 1
+
+    def _process(self, request, client_address):
+        handler = None
+        try:
+            handler = self.RequestHandlerClass(request, client_address, self)
+        except Exception:
+            self.handle_error(request, client_address)
+        if handler is not None and handler.detached:
+            # The relay loop owns the connection now
+            return
+        if handler is not None and handler.idle:
+            self.idle_connections[request] = handler.requests_served
+            self._dispatcher.add(request, client_address, handler.timeout)
+        else:
+            self.shutdown_request(request)
+
+    def shutdown_request(self, request):
+        self.idle_connections.pop(request, None)
+        super().shutdown_request(request)
+
+    def server_close(self):
+        super().server_close()
+        self._dispatcher.close()
+        self._pool.shutdown(wait=False, cancel_futures=True)
+        self._stream_pool.shutdown(wait=False, cancel_futures=True)
+
+
+def create_server(host, port, server_config, listen_socket=None):
+    """Build the HTTP server for the engine selected in the config's server block"""
+    engine = server_config.get('engine', DEFAULT_ENGINE)
+    options = {'reuse_port': server_config.get('reuse_port', False), 'listen_socket': listen_socket}
+    if engine == 'threading':
+        return ThreadedHTTPServer((host, port), VideoStreamHandler, **options)
+    if engine != 'pool':
+        print(f"⚠️  Unknown server engine '{engine}', using '{DEFAULT_ENGINE}'")
+    return PooledHTTPServer((host, port), VideoStreamHandler,
+                            workers=server_config.get('workers', DEFAULT_WORKERS),
+                            stream_workers=server_config.get('stream_workers', DEFAULT_STREAM_WORKERS),
+                            **options)
+
+
+def stop_on_sigterm(signum, frame):
+    # systemctl stop/restart drains exactly like Ctrl+C
+    raise KeyboardInterrupt
+
+
+def run_server(config, relay_hub, access_log, host, port, listen_socket=None, render_metrics=None,
+               reuse_port=None):
+    """Serve HTTP until Ctrl+C or SIGTERM, then drain the requests in flight"""
+    server_config = config.server
+    if reuse_port is not None:
+        server_config = dict(server_config, reuse_port=reuse_port)
+    with create_server(host, port, server_config, listen_socket) as httpd:
+        httpd.config = config
+        httpd.relay_hub = relay_hub
+        httpd.access_log = access_log
+        httpd.render_metrics = render_metrics or METRICS.render
+        httpd.static = StaticFiles(STATIC_DIRECTORY)
+        if isinstance(httpd, PooledHTTPServer):
+            httpd.relay_loop = relay_hub.loop
+        assets = build_page_assets()
+        httpd.assets = {asset.name: asset for asset in assets.values()}
+        httpd.main_page = RenderedPage(render_main_page(config.config, assets))
+        config.add_listener(lambda store: setattr(httpd, 'main_page', RenderedPage(render_main_page(store.config, assets))))
+        # Viewers of the process being replaced are about to reconnect
+        relay_hub.prewarm()
+        sd_notify('READY=1')
+        try:
+            httpd.serve_forever()
+        except KeyboardInterrupt:
+            # A worker is sent SIGTERM by its ingest process even when Ctrl+C already reached it
+            signal.signal(signal.SIGTERM, signal.SIG_IGN)
+            drain_seconds = config.server.get('drain_seconds', DRAIN_SECONDS)
+            print(f"\n🛑 Server stopping, draining connections for up to {drain_seconds}s")
+            sd_notify('STOPPING=1')
+            httpd.stop_accepting()
+            relay_hub.drain(DRAIN_RETRY_MS)
+            if not httpd.wait_idle(drain_seconds):
+                print(f"⚠️  {httpd.active_requests} requests still running; closing them")
+
+
+class WorkerClient:
+    """A worker process's end of its pipe to the ingest process"""
+
+    def __init__(self, conn):
+        self.conn = conn
+        self._send_lock = threading.Lock()
+        self._calls = {}
+        self._tokens = itertools.count()
+        self._configured = threading.Event()
+        self._stop = threading.Event()
+
+    def start(self, config, hub):
+        """Apply whatever the ingest process sends; returns once its first config is in"""
+        threading.Thread(target=self._receive, args=(config, hub), name='worker-client', daemon=True).start()
+        threading.Thread(target=self._push_metrics, name='worker-metrics', daemon=True).start()
+        if not self._configured.wait(WORKER_RPC_SECONDS):
+            raise TimeoutError("no config from the ingest process")
+
+    def stop(self):
+        self._stop.set()
+
+    def send(self, message):
+        with self._send_lock:
+            try:
+                self.conn.send(message)
+            except (OSError, ValueError):
+                # The ingest process is gone; _receive is already stopping this worker
+                pass
+
+    def call(self, kind, *args):
+        """Ask the ingest process something and wait for its answer"""
+        token = next(self._tokens)
+        reply = self._calls[token] = [threading.Event(), None]
+        self.send((kind, token) + args)
+        if not reply[0].wait(WORKER_RPC_SECONDS):
+            self._calls.pop(token, None)
+            raise TimeoutError(f"the ingest process did not answer {kind}")
+        return reply[1]
+
+    def metrics(self):
+        """/metrics of every process, merged by the ingest process"""
+        return self.call('metrics', *METRICS.snapshot())
+
+    def _push_metrics(self):
+        # Keeps this worker's counters in the /metrics the other workers serve
+        while not self._stop.wait(WORKER_METRICS_SECONDS):
+            self.send(('push', *METRICS.snapshot()))
+
+    def _receive(self, config, hub):
+        while True:
+            try:
+                message = self.conn.recv()
+            except (EOFError, OSError):
+                if not self._stop.is_set():
+                    print("⚠️  Ingest process went away; stopping worker")
+                    os.kill(os.getpid(), signal.SIGTERM)
+                return
+            kind = message[0]
+            try:
+                if kind == 'config':
+                    hub.rings = message[2]
+                    config.apply(message[1])
+                    self._configured.set()
+                elif kind == 'status':
+                    hub.mirror(message[1])
+                elif kind == 'event':
+                    hub.forward(message[1], message[2])
+                elif kind == 'reply':
+                    reply = self._calls.pop(message[1], None)
+                    if reply is not None:
+                        reply[1] = message[2]
+                        reply[0].set()
+            except Exception as e:
+                print(f"❌ Worker failed to apply {kind} from the ingest process: {e}")
+
+
+def run_worker(config_path, conn, wake, listen_socket):
+    """Entry point of a worker process: serve HTTP with frames from the ingest process"""
+    # Only the ingest process reports to systemd
+    os.environ.pop('NOTIFY_SOCKET', None)
+    signal.signal(signal.SIGTERM, stop_on_sigterm)
+    config = ConfigStore(config_path)
+    client = WorkerClient(conn)
+    relay_hub = WorkerRelayHub(config, client, wake)
+    access_log = AccessLog(config.server)
+    try:
+        relay_hub.start()
+        config.add_listener(relay_hub.reconfigure)
+        access_log.start()
+        config.add_listener(lambda store: access_log.configure(store.server))
+        METRICS.add_collector(relay_hub.collect_metrics)
+        client.start(config, relay_hub)
+        host, port = config.server.get('host', '0.0.0.0'), config.server.get('port', 8000)
+        run_server(config, relay_hub, access_log, host, port, listen_socket,
+                   render_metrics=client.metrics, reuse_port=True)
+    except KeyboardInterrupt:
+        pass
+    except Exception as e:
+        print(f"❌ Worker {os.getpid()} failed: {e}")
+    finally:
+        client.stop()
+        relay_hub.stop()
+        access_log.close()
+
+
+class WorkerHandle:
+    """The ingest process's side of one worker process"""
+
+    def __init__(self, index, process, conn, wake):
+        self.index = index
+        self.process = process
+        self.conn = conn
+        self.wake = wake
+        self.wake_fd = wake.fileno()
+        self.queue = queue.Queue(WORKER_QUEUE_SIZE)
+        # Upstream holds taken on the worker's behalf, released if it dies
+        self.holds = collections.Counter()
+        self.metrics = None
+        self.closed = False
+        self._overflowed = False
+
+    def send(self, message):
+        """Queue a message for the worker without ever blocking the caller"""
+        try:
+            self.queue.put_nowait(message)
+        except queue.Full:
+            if not self._overflowed:
+                print(f"⚠️  Worker {self.index} is not keeping up; dropping its messages")
+                self._overflowed = True
+
+    def send_loop(self):
+        while not self.closed:
+            try:
+                message = self.queue.get(timeout=1)
+            except queue.Empty:
+                continue
+            try:
+                self.conn.send(message)
+            except (OSError, ValueError):
+                return
+
+
+class WorkerPool:
+    """Worker processes serving HTTP on one port, fed frames by this ingest process
+
+    Workers are fresh interpreters - spawned, not forked, since this process
+    already runs threads - that bind the port with SO_REUSEPORT so the kernel
+    spreads connections across them, or share the socket systemd passed in.
+    A worker that dies is restarted.
+    """
+
+    def __init__(self, config_path, count, listen_socket=None):
+        self.config_path = config_path
+        self.count = count
+        self.listen_socket = listen_socket
+        self.context = multiprocessing.get_context('spawn')
+        self.handles = ()
+        self.config = None
+        self.hub = None
+        self._lock = threading.Lock()
+        self._stop = threading.Event()
+
+    def start(self, config, hub):
+        self.config, self.hub = config, hub
+        for index in range(self.count):
+            self._spawn(index)
+        threading.Thread(target=self._supervise, name='worker-supervisor', daemon=True).start()
+        print(f"👷 Started {self.count} worker processes")
+
+    def _spawn(self, index):
+        conn, child_conn = self.context.Pipe()
+        wake_reader, wake_writer = self.context.Pipe(duplex=False)
+        process = self.context.Process(target=run_worker, name=f'worker-{index}',
+                                       args=(self.config_path, child_conn, wake_reader, self.listen_socket))
+        process.start()
+        child_conn.close()
+        wake_reader.close()
+        os.set_blocking(wake_writer.fileno(), False)
+        handle = WorkerHandle(index, process, conn, wake_writer)
+        threading.Thread(target=handle.send_loop, name=f'worker-{index}-send', daemon=True).start()
+        threading.Thread(target=self._receive, args=(handle,), name=f'worker-{index}-receive',
+                         daemon=True).start()
+        with self._lock:
+            handle.send(('config', self.config.config, self.hub.rings()))
+            handle.send(('status', self.hub.status()))
+            self.handles = self.handles + (handle,)
+
+    def wait(self):
+        """Block until Ctrl+C or SIGTERM"""
+        while True:
+            signal.pause()
+
+    def stop(self, timeout):
+        """SIGTERM every worker, so each drains its viewers, and wait for them to exit"""
+        self._stop.set()
+        handles = self.handles
+        print(f"🛑 Stopping {len(handles)} worker processes")
+        for handle in handles:
+            if handle.process.is_alive():
+                handle.process.terminate()
+        deadline = time.monotonic() + timeout + 1
+        for handle in handles:
+            handle.process.join(max(deadline - time.monotonic(), 0))
+            if handle.process.is_alive():
+                handle.process.kill()
+                handle.process.join()
+            self._retire(handle)
+
+    def _retire(self, handle):
+        with self._lock:
+            self.handles = tuple(other for other in self.handles if other is not handle)
+        handle.closed = True
+        handle.conn.close()
+        # Closed on the loop, so wake() can't write to a descriptor number already reused
+        self.hub.loop.call(handle.wake.close)
+
+    def _supervise(self):
+        while not self._stop.is_set():
+            processes = {handle.process.sentinel: handle for handle in self.handles}
+            for sentinel in multiprocessing.connection.wait(list(processes), timeout=1):
+                if self._stop.is_set():
+                    return
+                handle = processes[sentinel]
+                handle.process.join()
+                print(f"⚠️  Worker {handle.index} exited with code {handle.process.exitcode}; restarting")
+                self._retire(handle)
+                if self._stop.wait(WORKER_RESTART_SECONDS):
+                    return
+                self._spawn(handle.index)
+
+    def _receive(self, handle):
+        hub = self.hub
+        while True:
+            try:
+                message = handle.conn.recv()
+            except (EOFError, OSError):
+                break
+            kind = message[0]
+            try:
+                if kind in ('acquire', 'release', 'prewarm'):
+                    relay = hub.relays.get(message[1])
+                    if relay is None:
+                        continue
+                    if kind == 'acquire':
+                        relay.acquire()
+                        handle.holds[relay] += 1
+                    elif kind == 'release':
+                        # Holds on a relay replaced since are gone with it
+                        if handle.holds[relay] > 0:
+                            handle.holds[relay] -= 1
+                            relay.release()
+                    else:
+                        relay.prewarm()
+                elif kind == 'record':
+                    relay = hub.relays.get(message[2])
+                    reply = None
+                    if relay is not None and relay.recorder is not None:
+                        segment, until = relay.recorder.trigger(message[3])
+                        reply = (segment.path, until)
+                    handle.send(('reply', message[1], reply))
+                elif kind == 'metrics':
+                    handle.metrics = message[2:]
+                    others = [other.metrics for other in self.handles if other.metrics is not None]
+                    handle.send(('reply', message[1], METRICS.render(others)))
+                elif kind == 'push':
+                    handle.metrics = message[1:]
+            except Exception as e:
+                print(f"❌ Error handling {kind} from worker {handle.index}: {e}")
+        for relay, count in handle.holds.items():
+            for _ in range(count):
+                relay.release()
+        handle.holds.clear()
+
+    def configure(self, store):
+        with self._lock:
+            for handle in self.handles:
+                handle.send(('config', store.config, self.hub.rings()))
+                handle.send(('status', self.hub.status()))
+
+    def broadcast_event(self, event, data):
+        for handle in self.handles:
+            handle.send(('event', event, data))
+
+    def wake(self):
+        """Tell every worker a frame is waiting in shared memory; called on the relay loop"""
+        for handle in self.handles:
+            try:
+                os.write(handle.wake_fd, b'\0')
+            except OSError:
+                # A full pipe already has wake-ups pending
+                pass
+
+
+def worker_processes(setting, listen_socket):
+    """How many HTTP worker processes the server block's `processes` asks for; 1 means none"""
+    if setting == 'auto':
+        count = os.cpu_count() or 1
+    else:
+        try:
+            count = max(int(setting), 1)
+        except (TypeError, ValueError):
+            print(f"⚠️  Invalid processes setting '{setting}', using 1")
+            return 1
+    if count > 1 and listen_socket is None and not hasattr(socket, 'SO_REUSEPORT'):
+        print("⚠️  Several processes need SO_REUSEPORT, which this platform lacks; using 1")
+        return 1
+    return count
 
 def main():
     """Main function to start the HTTP server"""
-    # Load server configuration
-    try:
-        config_path = os.path.join(os.path.dirname(__file__), 'config.json')
-        with open(config_path, 'r') as f:
-            config = json.load(f)
-        PORT = config.get('server', {}).get('port', 8000)
-        HOST = config.get('server', {}).get('host', '0.0.0.0')
-    except:
-        PORT = 8000
-        HOST = '0.0.0.0'
+    parser = argparse.ArgumentParser(description="Raspberry Pi video stream server")
+    parser.add_argument('--config', default=CONFIG_PATH, help="path to config.json")
+    args = parser.parse_args()
+
+    config = ConfigStore(args.config)
+    SERVER_CONFIG = config.server
+    PORT = SERVER_CONFIG.get('port', 8000)
+    HOST = SERVER_CONFIG.get('host', '0.0.0.0')
+    listen_socket = systemd_socket()
+    if listen_socket is not None:
+        HOST, PORT = listen_socket.getsockname()[:2]
+    processes = worker_processes(SERVER_CONFIG.get('processes', 1), listen_socket)
     
     print(f"🚀 Starting Video Stream Server on {HOST}:{PORT}")
     print(f"📺 Open your browser and go to: http://localhost:{PORT}")
     print(f"🔧 Configure your Raspberry Pi stream URLs in config.json")
     print(f"⏹️  Press Ctrl+C to stop the server")
     print("=" * 50)
+    if listen_socket is not None:
+        print("🔌 Using the listening socket passed in by systemd")
+    signal.signal(signal.SIGTERM, stop_on_sigterm)
+    
+    pool = WorkerPool(args.config, processes, listen_socket) if processes > 1 else None
+    relay_hub = IngestRelayHub(config, pool) if pool is not None else RelayHub(config)
+    relay_hub.start()
+    config.add_listener(relay_hub.reconfigure)
+    access_log = AccessLog(SERVER_CONFIG)
+    access_log.start()
+    config.add_listener(lambda store: access_log.configure(store.server))
+    peers = PeerDirectory(config)
+    peers.start()
+    config.add_listener(peers.configure)
+    METRICS.add_collector(relay_hub.collect_metrics)
+    METRICS.add_collector(peers.collect_metrics)
     
     try:
-        with socketserver.TCPServer((HOST, PORT), VideoStreamHandler) as httpd:
-            httpd.serve_forever()
+        if pool is not None:
+            pool.start(config, relay_hub)
+            config.add_listener(pool.configure)
+            config.watch()
+            sd_notify('READY=1')
+            pool.wait()
+        else:
+            config.watch()
+            run_server(config, relay_hub, access_log, HOST, PORT, listen_socket)
     except KeyboardInterrupt:
         print("\n🛑 Server stopped by user")
     except Exception as e:
         print(f"❌ Error starting server: {e}")
+    finally:
+        if pool is not None:
+            sd_notify('STOPPING=1')
+            pool.stop(config.server.get('drain_seconds', DRAIN_SECONDS))
+        config.stop()
+        peers.stop()
+        relay_hub.stop()
+        access_log.close()
 
 if __name__ == "__main__":
-    main()
\ No newline at end of file
+    main()